@@ -0,0 +1,18 @@
+/*
+ * LD_PRELOAD shim for bench/spawn.sh - touches HEAP_MB MiB of heap before main so the shell's address space is large
+ * when it launches commands, and drops itself from the environment so the commands start small.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+// kept so the allocation is not optimised away
+char *heap_touched;
+
+__attribute__((constructor)) static void heap_touch(void) {
+    char const *mb = getenv("HEAP_MB");
+    size_t size = (size_t) (mb ? strtol(mb, NULL, 0) : 256) << 20;
+    heap_touched = malloc(size);
+    if (heap_touched) memset(heap_touched, 1, size);
+    unsetenv("LD_PRELOAD");
+    unsetenv("HEAP_MB");
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Wall time and peak RSS of one pass over a script of comment lines, read through getline (the revision before mapped
+# scripts) and through mmap (that revision) - timed by the time prefix of the current tree.
+#   usage: bench/mmap.sh [SIZE_MB]   (default 1024; the script is written to TMPDIR)
+cd "$(dirname "$0")/.." || exit 1
+size=${1:-1024}
+after=$(git log -1 --format=%h --grep='^\[user-010\] Read script files')
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+${CC:-cc} -std=gnu11 -O2 -o "$work/smallsh" smallsh.c || exit 1
+for rev in "$after^" "$after"; do
+    git show "$rev:smallsh.c" > "$work/rev.c" || exit 1
+    ${CC:-cc} -std=gnu11 -O2 -w -o "$work/$rev" "$work/rev.c" || exit 1
+done
+yes '# a comment line of the generated script, skipped after wordsplit' | head -c $((size << 20)) > "$work/script"
+cat "$work/script" > /dev/null   # warm the page cache
+
+for rev in "$after^" "$after"; do
+    echo "time $work/$rev $work/script" > "$work/line"
+    printf '%s: ' "$rev"
+    "$work/smallsh" "$work/line" 2>&1 | awk '$1 == "real" || $1 == "maxrss" { printf "%s %s %s  ", $1, $2, $3 } END { print "" }'
+done
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Commands/sec of the posix_spawn launch path against the fork path (USE_SPAWN=0), in script mode, with a small
+# shell and again with HEAP_MB (default 256) MiB of touched heap in the shell.
+#   usage: bench/spawn.sh [LINES]
+cd "$(dirname "$0")/.." || exit 1
+lines=${1:-2000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+${CC:-cc} -std=gnu11 -O2 -o "$work/spawn" smallsh.c || exit 1
+${CC:-cc} -std=gnu11 -O2 -DUSE_SPAWN=0 -o "$work/fork" smallsh.c || exit 1
+${CC:-cc} -O2 -shared -fPIC -o "$work/heap.so" bench/heap.c || exit 1
+i=0
+while [ $i -lt "$lines" ]; do echo /bin/true; i=$((i + 1)); done > "$work/script"
+
+# prints commands/sec of one run of the script
+run() {
+    start=$(date +%s%N)
+    "$@" "$work/script" || exit 1
+    end=$(date +%s%N)
+    echo "$lines $start $end" | awk '{ printf "%.0f commands/sec\n", $1 * 1e9 / ($3 - $2) }'
+}
+
+for path in spawn fork; do
+    printf '%s: ' "$path"
+    run "$work/$path"
+    printf '%s, %s MiB heap: ' "$path" "${HEAP_MB:-256}"
+    run env LD_PRELOAD="$work/heap.so" HEAP_MB="${HEAP_MB:-256}" "$work/$path"
+done
@@ -0,0 +1,40 @@
+/*
+ * Tokenize + expand micro-benchmark - runs one 20-word line with $$, $? and ${HOME} through a revision's wordsplit
+ * and expand the way its main loop does, and prints lines/sec. Built by bench/tokenize.sh, which passes the
+ * revision's source as SMALLSH_C and LINE_ARENA=1 when that revision has the per-line arena.
+ */
+#define main smallsh_main
+#include SMALLSH_C
+#undef main
+
+#include <time.h>
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? strtol(argv[1], NULL, 0) : 1000000;
+    char const *line = "echo alpha $$ beta $? ${HOME}/gamma delta-$$ epsilon ${HOME} zeta eta theta $? iota kappa"
+                       " lambda ${HOME}/mu nu xi omicron-$$\n";
+    struct sh_options *opts = calloc(1, sizeof *opts);
+    if (!opts) err(1, "calloc");
+    opts->parent_pid = getpid();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long l = 0; l < iterations; l++) {
+#if LINE_ARENA
+        arena_reset(&line_arena);
+        opts->n_words = wordsplit(line);
+        for (size_t i = 0; i < opts->n_words; ++i) words[i] = expand(words[i], opts);
+#else
+        opts->n_words = wordsplit(line);
+        for (size_t i = 0; i < opts->n_words; ++i) {
+            char *exp_word = expand(words[i], opts);
+            free(words[i]);
+            words[i] = exp_word;
+        }
+#endif
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%zu words, %ld lines in %.3f s: %.0f lines/sec\n", opts->n_words, iterations, secs, iterations / secs);
+    return 0;
+}
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Tokenize + expand lines/sec before and after the per-line arena - builds bench/tokenize.c against both revisions.
+#   usage: bench/tokenize.sh [ITERATIONS]
+cd "$(dirname "$0")/.." || exit 1
+after=$(git log -1 --format=%h --grep='^\[user-001\] Allocate words')
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+for rev in "$after^" "$after"; do
+    git show "$rev:smallsh.c" > "$work/smallsh.c" || exit 1
+    arena=$(grep -c '^void arena_reset' "$work/smallsh.c")
+    ${CC:-cc} -std=gnu11 -O2 -w -DSMALLSH_C="\"$work/smallsh.c\"" -DLINE_ARENA="$arena" -o "$work/tokenize" \
+        bench/tokenize.c || exit 1
+    printf '%s: ' "$rev"
+    "$work/tokenize" "$@"
+done
@@ -0,0 +1,24 @@
+#!/bin/sh
+# p50 of the expand and parse_words phases of --bench expand, before (getenv) and after the shell variable table,
+# with the current environment and with EXTRA (default 1000) more variables exported.
+#   usage: bench/vars.sh [EXTRA]
+cd "$(dirname "$0")/.." || exit 1
+extra=${1:-1000}
+after=$(git log -1 --format=%h --grep='^\[user-017\] Add shell variables')
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+for rev in "$after^" "$after"; do
+    git show "$rev:smallsh.c" > "$work/rev.c" || exit 1
+    ${CC:-cc} -std=gnu11 -O2 -w -o "$work/$rev" "$work/rev.c" || exit 1
+done
+vars=$(i=0; while [ $i -lt "$extra" ]; do echo "BENCH_VAR_$i=value-$i"; i=$((i + 1)); done)
+
+for rev in "$after^" "$after"; do
+    for n in 0 "$extra"; do
+        printf '%s, %s extra variables: ' "$rev" "$n"
+        if [ "$n" = 0 ]; then set --; else set -- $vars; fi
+        env "$@" "$work/$rev" --bench expand --bench-iterations 5 |
+            awk -F, '$2 == "expand" || $2 == "parse_words" { printf "%s p50 %s ns  ", $2, $4 } END { print "" }'
+    done
+done
@@ -7,18 +7,68 @@
  * Description: Creation of a small shell program for running commands from the command line.  The program does the
  * following:
  * 1. Reads input from the command line OR from a file if a valid CMD line argument file is provided.
+ * 1a.  smallsh -j N [-o] FILE runs up to N lines of the file at once; -o emits each line's output in script order.
+ *      Built-ins that change the shell and lone assignments wait for the running lines; the exit status is that of
+ *      the first failing line.
+ * 1b.  Lines typed at a terminal (or read from stdin with --history FILE) are kept in $HISTFILE, by default
+ *      ~/.smallsh_history - an mmap'd ring file that every shell using it appends to under flock.  history [N]
+ *      lists them, history -s TEXT... searches them through a trigram index built while the prompt is idle, and
+ *      !!, !N, !PREFIX and !?TEXT bring one back before the line is split.
  * 2. First word in the command is a built-in executable command (cd or exit) or a linux executable program.
+ *      Built-ins that change the shell (cd, exit, jobs, history, ...) take redirections of stdin, stdout and
+ *      stderr, and are refused in a pipeline or with &.
+ * 2a.  Resolved command paths are cached; hash lists them with hit counts and hash -r clears them.
+ * 2b.  time CMD... reports wall, user and sys time, max RSS and context switches of the pipeline; --acct FILE logs one
+ *      record (pid, status, rusage, wall time, command) per completed child.
+ * 2c.  A lone foreground echo, printf, test/[, true, false, pwd or kill runs inside the shell without fork/exec;
+ *      anything it does not handle (errors, --help, locale dependent output, explicit paths) runs the real program.
+ *      tests/parity.sh checks each against its /usr/bin program (stdout, stderr, status, redirections).
+ * 2d.  $(COMMAND) expands to the output of COMMAND (run like any other line, so substitutions nest) without its
+ *      trailing newlines; the result stays within the word it appears in.
+ * 2e.  NAME=value sets a shell variable, export NAME[=value]... and unset NAME... manage the environment of
+ *      commands, and NAME=value CMD... sets it for one command only; ${NAME} reads the shell's variables.
+ * 2f.  Arguments with *, ? or [...] expand to the sorted paths they match (kept as typed when none do); each
+ *      directory is read once per line with getdents64, however many patterns use it.
+ * 2g.  for NAME in WORD... / do / done, while CMD / do / done and if CMD / then / elif CMD / else / fi blocks (do
+ *      and then may end the header line after a ;), with break [N] and continue [N].  A block is split once and
+ *      run from that form, re-reading only its $?, $!, ${NAME} and $(...) slots; for splits its words at blanks.
  * 3. Enables input/output redirection -
  * 3a.  Uses < + input file to read input from a file
  * 3b.  Uses > + write file to write (replace) output to a file
  * 3c.  Uses >> + append file to append output to a file
+ * 3d.  Uses | to connect commands into a pipeline (each pipeline runs in its own process group; set -o pipefail
+ *      reports the last failing stage).  The built-in ztee [-a] FILE... stage copies a pipe with splice/tee.
+ * 3e.  Uses << DELIM for a here-document (the following lines up to DELIM, expanded unless DELIM is quoted) and
+ *      <<< WORD for a here-string; the text reaches stdin through a pipe or memfd, never a file.
+ * 3f.  N<, N>, N>>, N<> (read and write), N>&M and N<&M (copy of descriptor M), &> and &>> (stdout and stderr)
+ *      redirect any descriptor, the target attached (2>err, 2>&1) or the next word.  They are parsed once per line
+ *      into a list of operations the child applies in order with dup3, or posix_spawn file actions.
  * 4. If the last word in the command is the & symbol, it will run the process in the background.
+ * 4a.  jobs-max N (or --jobs-max N) runs at most N background pipelines at once; the rest queue in FIFO order, or
+ *      by $JOB_PRIORITY (higher first), and start as slots free up.  jobs lists running and queued jobs, and
+ *      wait [PID|%N...] and wait -n sleep until those jobs, or the next one, are done.
+ * 4b.  timeout [-k DURATION] DURATION CMD... sends SIGTERM to the pipeline once DURATION has passed and SIGKILL
+ *      after -k (default 5s); it exits 124, or 137 if killed.  ulimit [-H|-S] [-a | -cdflnstuv [VALUE]] limits
+ *      commands started after it, and --cgroup DIR runs each job in a cgroup v2 leaf of its own (capped by
+ *      --cgroup-memory and --cgroup-cpu) and reports its peak memory.
  * 5. If no background, symbol, it will perform a blocking wait on the execution of the foreground process.
  * 6. Will monitor the status of all processes and provide outputs for their pid's and exit statuses.
+ * 6a.  Background jobs are reported the moment they finish, even at an idle prompt - the main loop waits in epoll on
+ *      stdin, a signalfd for SIGINT/SIGCHLD and a pidfd per background process.
  * 7. Provides the following signal handling:
  * 7a.  Will ignore ALL SIGTSTP signals
  * 7b.  Will ignore ALL SIGINT signals except when reading commands from the command line
  * 7c.  Will reset all signals in each child process
+ * 8. Measures and serves the shell itself -
+ * 8a.  smallsh --bench WORKLOAD [--bench-iterations N] [--bench-format csv|json] replays a script or a canned workload
+ *      (tiny, long, expand, background, builtin) and reports p50/p99/max per shell phase; make bench replays every
+ *      canned workload.
+ * 8b.  smallsh --serve SOCK answers command lines sent to a Unix socket, each connection in a shell of its own
+ *      (cwd, $?, $!); --client SOCK [FILE] sends lines and prints the streamed stdout, stderr and status, and
+ *      --client SOCK --load-test N [-j C] [COMMAND] reports requests/s and latencies.
+ * 8c.  --metrics FILE [--metrics-format prometheus|json] [--metrics-interval SECONDS] writes counters and gauges
+ *      (lines, commands, spawn failures, background jobs, reap latency, phase times) to FILE on SIGUSR1, every
+ *      interval and at exit; -j and --serve workers count into the same totals.
  *
  * The wordsplit, param_scan, build_str, and expand methods were provided by the professor.  It would have been easier
  * to build my own methods, but wanted to demonstrate the ability to read and understand existing code and build
@@ -30,6 +80,8 @@
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -43,29 +95,477 @@
 #include <sys/fcntl.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <getopt.h>
+#include <sys/pidfd.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <stdio_ext.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/file.h>
 
-#ifndef MAX_WORDS
-#define MAX_WORDS 512
+/* launch commands with posix_spawn (vfork-style, no page table copy) - 0 always forks */
+#ifndef USE_SPAWN
+#define USE_SPAWN 1
 #endif
 
+/* epoll keys - the event source in the high half, a background job's pid in the low half */
+enum watch { WATCH_INPUT = 1, WATCH_SIGNALS, WATCH_JOB, WATCH_TIMER };
+#define WATCH_KEY(source, pid) ((uint64_t) (source) << 32 | (uint32_t) (pid))
+
+/* what wait_events saw */
+#define EVENT_INPUT 1       // stdin is readable
+#define EVENT_INTERRUPT 2   // SIGINT at the prompt
+#define EVENT_JOBS 4        // a background job was reported
+
+/* --serve frames - a type byte and a big endian 32 bit payload length, then the payload */
+#define FRAME_HEADER 5
+#define FRAME_MAX (1 << 20)     // largest payload - longer output is sent as several frames
+#define FRAME_COMMAND 'C'       // client: one or more whole input lines
+#define FRAME_STDOUT 'O'        // server: output of the request
+#define FRAME_STDERR 'E'
+#define FRAME_STATUS 'X'        // server: $? after the request (4 bytes, big endian) - ends the reply
+
+/* returned by an in-process builtin whose arguments need the real program (usage errors, --help, locale output) */
+#define BUILTIN_EXTERNAL -1
+
+/* timeout prefix - SIGKILL follows SIGTERM after this long unless -k says otherwise */
+#define TIMEOUT_KILL_NS 5000000000u
+
+/* background job - id is the user facing job number, shared by every process of a pipeline; command (owned by the
+ * table) and start_ns feed the accounting log and the time built-in; last marks the pipeline's last stage, which
+ * holds its jobs-max slot, the timerfd of a timeout prefix (timed_out counts the signals sent) and the --cgroup
+ * leaf (owned by the table) */
+struct job {
+    pid_t pid, pgid;
+    int id, timed, pidfd, last;
+    char *command;
+    uint64_t start_ns;
+    int timer_fd, timed_out;
+    uint64_t kill_ns;
+    char *cgroup;
+};
+
+/* background line waiting for a jobs-max slot - words is one allocation holding the pointers and the text */
+struct queued_job {
+    char **words;
+    size_t n_words;
+    int id, priority;
+    uint64_t seq;
+};
+
+/* live background jobs in a dense array, indexed by pid through an open addressing map of (array index + 1) - each
+ * job's pidfd is registered with the epoll instance watch_fd (-1 for none). Lines over the jobs-max limit wait in
+ * queue, a binary heap. */
+struct job_table {
+    struct job *jobs;
+    size_t len, cap;
+    size_t *slots;
+    size_t n_slots;
+    int next_id, watch_fd;
+    struct queued_job *queue;
+    size_t queue_len, queue_cap;
+    uint64_t queue_seq;
+    int max_running, running, launch_id;    // jobs-max (0 for no limit), pipelines running, id for the next launch
+    int finished, last_status;              // pipelines reaped so far and the status of the last one, for wait -n
+    pid_t wait_pid;                         // process or job wait is after, and its status once reaped
+    int wait_id, wait_status;
+    uint64_t wake_ns;                       // --metrics: when the event loop woke, for the reap latency
+};
+
+/* command name resolved through $PATH - hits counts the commands run through it */
+struct path_entry {
+    char *name, *path;
+    unsigned long hits;
+};
+
+/* open addressing map of command name to absolute path, valid for the PATH value it was filled under */
+struct path_cache {
+    struct path_entry *entries;
+    size_t len, n_slots;
+    char *path_env;
+};
+
+/* shell variable - pair is the whole NAME=value string, so exported ones go into envp as they are */
+struct var {
+    char *pair;
+    size_t name_len;
+    int exported;
+};
+
+/* open addressing map of shell variables, seeded from environ - envp (installed as environ) holds the exported ones
+ * and is rebuilt only after one of them changed; pairs it still points to wait in retired until then */
+struct var_table {
+    struct var *vars;
+    size_t len, n_slots;
+    char **envp, **retired;
+    size_t n_retired, retired_cap;
+    int env_dirty;
+};
+
+/* one line of a parallel batch - output buffers are only used in ordered mode */
+struct batch_job {
+    pid_t pid;
+    int pidfd;          // readable once the worker exits (-1 on old kernels)
+    int out_fd, err_fd, done, status;
+};
+
+/* parallel batch mode (-j) - lines run in workers, queued in script order until they are emitted */
+struct batch {
+    int max_jobs, ordered, running, status;
+    struct batch_job *queue;
+    size_t head, len, cap;
+};
+
+/* phases timed by --bench */
+enum bench_phase {
+    BENCH_GETLINE, BENCH_WORDSPLIT, BENCH_EXPAND, BENCH_PARSE, BENCH_SPAWN, BENCH_WAIT, BENCH_PHASES
+};
+
+/* samples per phase in nanoseconds - exec_ns is the spawn + wait time of the current line */
+struct bench {
+    uint64_t *samples[BENCH_PHASES];
+    size_t len[BENCH_PHASES], cap[BENCH_PHASES];
+    uint64_t exec_ns;
+    int iterations, iteration, json;
+};
+
+/* --metrics counters - plain relaxed adds into one shared page, so batch and --serve workers count into the shell's
+ * totals; timing is set by --metrics, and then one line in METRICS_SAMPLE has its phases timed */
+#define METRICS_SAMPLE 16
+struct metrics {
+    uint64_t lines, commands, builtins, spawn_failures, jobs_started, jobs_finished;
+    uint64_t reap_ns, reap_max_ns;          // event loop wakeup to a finished background process being reported
+    uint64_t phase_ns[BENCH_PHASES];
+    int timing;
+};
+#define METRIC_ADD(name, n) __atomic_fetch_add(&metrics->name, (n), __ATOMIC_RELAXED)
+// raises the counter to n unless another process already stored more
+#define METRIC_MAX(name, n) do { \
+        uint64_t metric_old = __atomic_load_n(&metrics->name, __ATOMIC_RELAXED); \
+        while (metric_old < (n) && !__atomic_compare_exchange_n(&metrics->name, &metric_old, (n), 1, \
+                                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { } \
+    } while (0)
+
+/* history file - a header page, then a ring of records (a 4 byte length and the line, padded to 8 bytes) shared by
+ * every shell that maps it and appended under flock. Offsets only grow and are taken modulo ring; head is the oldest
+ * record kept, tail the end of the newest, and first_seq/next_seq number the lines from head to tail. */
+#define HISTORY_MAGIC 0x31545349484d53ull  // "SMHIST1"
+#define HISTORY_HEADER 4096
+#define HISTORY_RING (64u << 20)
+#define HISTORY_WRAP UINT32_MAX             // record length of the filler before the ring wraps
+#define HISTORY_LINE_MAX 65536              // longer lines are not kept
+#define HISTORY_IDLE_SLICE 16384            // entries indexed between two looks at stdin
+struct history_header {
+    uint64_t magic, ring, head, tail, first_seq, next_seq;
+};
+
+/* history line this shell has read from the ring - off is where its record starts */
+struct history_entry {
+    uint64_t seq, off;
+    uint32_t len;
+};
+
+/* trigram of the search index and the entries holding it, ascending */
+struct history_gram {
+    uint32_t gram, len, cap;
+    uint32_t *ids;
+};
+
+/* mapped history (fd -1 for none) - entries up to the seen offset of the ring, the first indexed of them in the open
+ * addressing trigram map grams; last_seq is this shell's own last line, for !! */
+struct history {
+    int fd;
+    struct history_header *hdr;
+    char *ring;
+    struct history_entry *entries;
+    size_t len, cap, indexed;
+    uint64_t seen, seen_seq, last_seq;
+    struct history_gram *grams;
+    size_t n_grams, n_slots;
+    char *line;                             // line after ! expansion
+    size_t line_cap;
+};
+
 struct sh_options {
-    pid_t parent_pid, process_pid, background_pid, background_pids[10];
-    int exit_status, child_status, index, error, background_count, children, interactive;
+    pid_t parent_pid, process_pid, background_pid, shell_pgid;
+    int exit_status, child_status, index, error, children, interactive, job_control, pipefail, acct_fd;
+    int epoll_fd, signal_fd, input_polled, input_eof;
+    int sigchld;                            // SIGCHLD a foreground timeout wait took from signal_fd, for wait_events
+    int queue_safe;                         // reading a new line - jobs-max slots freed meanwhile start queued lines
+    int serving;                            // --serve worker - a failed cd answers the request instead of exiting
+    int exiting;                            // exit ran - the main loop stops and cleans up as it does at EOF
+    struct job_table jobs;
+    struct path_cache paths;
+    struct var_table vars;
+    struct batch batch;
     size_t n_words;
     FILE *input;
-    struct sigaction sigint_action, sig_ignore, sigint_saved, sigtstp_saved;
+    char *line_buf, *map;                   // getline or stdin buffer, or the mapped script
+    size_t line_cap, map_size, map_pos, map_released;
+    char const *text;                       // lines held in memory (a --serve request), read ahead of the input
+    size_t text_len, text_pos;
+    size_t input_len, input_start;          // bytes read from stdin, start of the unread ones
+    struct sigaction sigint_action, sig_ignore, sigint_saved, sigtstp_saved, sigttou_saved;
+    sigset_t sigmask_saved;                 // signal mask at startup, restored in children
+    struct rlimit limits[RLIM_NLIMITS];     // ulimit - set in each child before exec
+    unsigned limits_set;                    // bit per resource in limits
+    int cgroup_fd;                          // --cgroup directory (-1 for none) and what goes into each job's leaf
+    char *cgroup_memory, *cgroup_cpu;       // memory.max and cpu.max contents, NULL for no limit
+    char **cgroup_stale;                    // leaves still holding processes when their job finished
+    size_t n_cgroup_stale;
+    struct history history;
+};
+
+/* timeout prefix of a line - ns 0 for none */
+struct timeout {
+    uint64_t ns, kill_ns;
+};
+
+/* redirection of a stage, parsed once by parse_words and applied in order - fd becomes the file path opened with
+ * flags (REDIR_OPEN), a copy of dup_fd (REDIR_DUP) or the stage's here-document/string (path is its text) */
+enum redir_type { REDIR_OPEN, REDIR_DUP, REDIR_HEREDOC, REDIR_HERESTRING };
+struct redir {
+    enum redir_type type;
+    int fd, flags, dup_fd;
+    char const *path;
+};
+
+/* one command of a pipeline - NULL terminated arguments and its slice of the redirection list */
+struct stage {
+    char **exec_arr;
+    struct redir *redir;
+    int redir_len;
+    char **assign;      // NAME=value prefixes - exported to this stage only
+    int assign_len;
+    int here_fd;        // stdin for the stage's here-documents/strings, set up by execute (-1 for none)
+    char **env;         // environment of the stage, set up by execute
+    int cgroup_fd;      // cgroup.procs of the job's --cgroup leaf, set up by execute (-1 for none)
+};
+
+/* command run inside the shell process - run returns the exit status or BUILTIN_EXTERNAL */
+struct builtin {
+    char const *name;
+    int (*run)(int argc, char *argv[]);
+};
+
+/* command that changes the shell itself - run takes its arguments from words[i + 1] on and sets $? */
+struct parent_builtin {
+    char const *name;
+    int (*run)(size_t i, struct sh_options *opts);
+};
+
+/* compiled path component of a glob pattern - one token per byte of the name, GLOB_STAR for any run of bytes */
+enum glob_type { GLOB_BYTE, GLOB_ANY, GLOB_SET, GLOB_STAR };
+
+struct glob_token {
+    enum glob_type type;
+    unsigned char byte;
+    uint8_t set[32];    // GLOB_SET members, one bit per byte value
+};
+
+/* literal prefix_len/suffix_len tokens and min_len reject most names before the scan; dot - may match a leading '.' */
+struct glob_pattern {
+    struct glob_token *tok;
+    size_t len, prefix_len, suffix_len, min_len;
+    int has_star, dot;
+};
+
+/* getdents64 records of one directory, read once per line */
+struct glob_chunk {
+    struct glob_chunk *next;
+    size_t len;
+    char data[];
+};
+
+struct glob_dir {
+    char const *path;
+    struct glob_chunk *chunks;
+};
+
+/* directories listed for the current line, by path */
+struct glob_cache {
+    struct glob_dir **dirs;
+    size_t len, n_slots;
+};
+
+struct glob_list {
+    char **paths;
+    size_t len, cap;
+};
+
+/* part of a compiled word - literal text, or a slot that expansion fills in on every run */
+enum tmpl_slot { SLOT_TEXT, SLOT_STATUS, SLOT_BACKGROUND, SLOT_VAR, SLOT_SUBST };
+struct tmpl_part {
+    enum tmpl_slot type;
+    char const *text;       // literal text, variable name or $(...) command
+    size_t len;
+};
+
+/* word of a compiled line - just text when it has no slots */
+struct tmpl_word {
+    char *text;
+    struct tmpl_part *parts;
+    size_t n_parts;
+};
+
+/* line of a block, split once - glob is set when a word may expand to paths */
+struct tmpl_line {
+    struct tmpl_word *words;
+    size_t n_words;
+    int glob;
+};
+
+/* for/while/if block or one line of one - line is the command, the condition or the for word list, body the do/then
+ * list and orelse the else list (elif is an if block of its own); levels is the N of break/continue N */
+enum block_type { BLOCK_LINE, BLOCK_FOR, BLOCK_WHILE, BLOCK_IF, BLOCK_BREAK, BLOCK_CONTINUE };
+struct block {
+    enum block_type type;
+    struct tmpl_line line;
+    char const *name;
+    int levels;
+    struct block *body, *orelse, *next;
+};
+
+/* bump allocator for one input line - every word and expanded word lives here and is released with one reset */
+struct arena_block {
+    struct arena_block *next;
+    size_t cap, used;
+    char data[];
 };
 
-char *words[MAX_WORDS];
+struct arena {
+    struct arena_block *head, *cur;
+};
+
+extern char **words;
+char heredoc_word[], heredoc_raw_word[];
+struct arena line_arena, block_arena;
+struct bench *bench;
+struct metrics *metrics;
+extern volatile sig_atomic_t metrics_due;
+extern int metrics_timing;
+void words_reserve(size_t n);
+void *arena_alloc(struct arena *a, size_t n);
+char *arena_strdup(struct arena *a, char const *s);
+void arena_reset(struct arena *a);
+struct job *job_add(struct job_table *t, pid_t pid, int id);
+int job_remove(struct job_table *t, pid_t pid);
+void job_queue_add(struct sh_options *opts);
+void job_queue_run(struct sh_options *opts);
+int jobs_max_builtin(size_t i, struct sh_options *opts);
+int jobs_builtin(size_t i, struct sh_options *opts);
+int wait_builtin(size_t i, struct sh_options *opts);
+struct job *job_find(struct job_table *t, pid_t pid);
+void job_table_free(struct job_table *t);
 int manage_background (struct sh_options *opts);
+int job_reap(struct sh_options *opts, pid_t pid);
+int job_reap_unwatched(struct sh_options *opts);
+void job_report(struct sh_options *opts, pid_t pid, int status, struct rusage *ru);
+void events_init(struct sh_options *opts);
+int wait_events(struct sh_options *opts, int timeout);
 int print_prompt (struct sh_options *opts);
-size_t wordsplit(char const *line);
+int map_script(struct sh_options *opts);
+ssize_t read_line(struct sh_options *opts, char const **line);
+size_t wordsplit(char const *line, size_t len);
+void read_heredocs(struct sh_options *opts);
+char *build_str(char const *start, char const *end);
+int here_document(struct stage *stage);
+size_t redir_parse(char const *word, struct redir r[2], int *n_ops);
+int redir_apply(struct stage const *stage);
 char *expand(char const *word, struct sh_options *opts);
+void expand_words(struct sh_options *opts);
+int block_keyword(char const *word);
+void run_block(struct sh_options *opts);
+void glob_words(struct sh_options *opts);
+char const *command_subst(struct sh_options *opts, char const *text, size_t len, size_t *out_len);
+void run_line(struct sh_options *opts, char const *line, size_t line_len);
 int parse_words(struct sh_options *opts);
-void exit_pgm(size_t i, struct sh_options *opts);
+void parse_words_timed(struct sh_options *opts);
+struct parent_builtin const *parent_builtin_find(char const *name);
+int run_parent_builtin(struct sh_options *opts, struct parent_builtin const *b, struct stage *stage, int detached);
+int exit_pgm(size_t i, struct sh_options *opts);
 int change_dir(size_t i, struct sh_options *opts);
-void sigint_handler (int sig);
-int execute(struct sh_options *opts, char* exec_arr[], char* redir_arr[], int redir_len, int background);
+int set_option(size_t i, struct sh_options *opts);
+void path_cache_clear(struct path_cache *c);
+char const *path_lookup(struct path_cache *c, char const *name, char const *path_env, int count);
+int hash_builtin(size_t i, struct sh_options *opts);
+size_t var_name_len(char const *word);
+struct var *var_find(struct var_table *t, char const *name, size_t len);
+char const *var_get(struct var_table *t, char const *name);
+void var_set(struct var_table *t, char const *assignment, int export);
+int var_unset(struct var_table *t, char const *name);
+char **var_environ(struct var_table *t);
+void var_init(struct var_table *t);
+void var_table_free(struct var_table *t);
+char **stage_env(struct sh_options *opts, struct stage *stage);
+int export_builtin(size_t i, struct sh_options *opts);
+int unset_builtin(size_t i, struct sh_options *opts);
+uint64_t monotonic_ns(void);
+char *stage_command(struct stage *stage);
+void acct_record(struct sh_options *opts, pid_t pid, int status, uint64_t wall_ns, struct rusage *ru,
+                 char const *command);
+void time_report(uint64_t wall_ns, struct rusage *ru);
+int execute(struct sh_options *opts, struct stage stages[], int n_stages, int background, int timed,
+            struct timeout const *timeout);
+int timeout_parse(struct sh_options *opts, size_t *i, struct timeout *timeout);
+void job_timeout(struct sh_options *opts, pid_t pid);
+int ulimit_builtin(size_t i, struct sh_options *opts);
+int history_open(struct history *h, char const *path);
+void history_close(struct history *h);
+void history_add(struct history *h, char const *line, size_t len);
+int history_idle(struct history *h);
+char const *history_expand(struct sh_options *opts, char const *line, size_t *len);
+int history_builtin(size_t i, struct sh_options *opts);
+void cgroup_init(struct sh_options *opts, char const *dir);
+char *cgroup_create(struct sh_options *opts);
+void cgroup_sweep(struct sh_options *opts);
+void cgroup_finish(struct sh_options *opts, char *name, pid_t pid, long maxrss);
+pid_t launch_stage(struct sh_options *opts, struct stage *stage, int in_fd, int out_fd, pid_t pgid);
+pid_t spawn_command(struct sh_options *opts, struct stage *stage, char const *path, int in_fd, int out_fd, pid_t pgid);
+uint64_t bench_now(void);
+void bench_sample(enum bench_phase phase, uint64_t ns);
+void bench_record(enum bench_phase phase, uint64_t start);
+FILE *bench_open(char const *workload);
+int bench_rewind(struct sh_options *opts);
+void bench_report(FILE *out, char const *workload);
+void metrics_init(char const *path, int json, int interval);
+void metrics_signals(int restart);
+void metrics_dump(struct sh_options *opts);
+void metrics_line(struct sh_options *opts);
+void batch_drain(struct sh_options *opts);
+int batch_dispatch(struct sh_options *opts);
+int frame_send(int fd, char type, void const *payload, uint32_t len);
+ssize_t frame_recv(int fd, char *type, char **buf, size_t *cap);
+void serve(struct sh_options *opts, char const *path);
+int serve_client(char const *path, FILE *input);
+int serve_load(char const *path, char const *command, long requests, int connections);
+int splice_all(int in_fd, int out_fd, ssize_t n, char *buf);
+int ztee(char *files[]);
+struct builtin const *builtin_find(struct var_table *vars, char const *name);
+int run_builtin(struct builtin const *b, struct stage *stage);
+int redir_save(struct stage const *stage, int saved[3]);
+void redir_restore(int saved[3]);
+int true_builtin(int argc, char *argv[]);
+int false_builtin(int argc, char *argv[]);
+int echo_builtin(int argc, char *argv[]);
+int printf_builtin(int argc, char *argv[]);
+int pwd_builtin(int argc, char *argv[]);
+int test_builtin(int argc, char *argv[]);
+int kill_builtin(int argc, char *argv[]);
 
 
 
@@ -74,35 +574,226 @@ int execute(struct sh_options *opts, char* exec_arr[], char* redir_arr[], int re
  * and each word/symbol seperated by a space.  Will continue executing until the exit command in stdin or until the
  * end of file is reached.
  * @param argc - char* of the program name (shellsh)
- * @param argv - char* of the input file name (OPTIONAL)
+ * @param argv - char* of the input file name (OPTIONAL), after options:
+ *               -j N, --jobs N - run up to N script lines at once
+ *               -o, --ordered - with -j, buffer each line's stdout/stderr and emit them in script order
+ *               --bench WORKLOAD - replay a canned workload (tiny, long, expand, background, builtin) or a script,
+ *                                  and report per phase timings instead of running interactively
+ *               --bench-iterations N - replays for --bench (default 10)
+ *               --bench-format csv|json - report format for --bench (default csv)
+ *               --acct FILE - append one accounting record per completed child process to FILE
+ *               --jobs-max N - run at most N background pipelines at once and queue the rest (as jobs-max N)
+ *               --metrics FILE - write counters (lines, commands, spawn failures, background jobs, reap latency,
+ *                                phase times) to FILE on SIGUSR1, every --metrics-interval seconds and at exit
+ *               --metrics-format prometheus|json - format of the --metrics file (default prometheus)
+ *               --metrics-interval SECONDS - period of the --metrics dumps, 0 for SIGUSR1 only (default 10)
+ *               --cgroup DIR - run each job in a leaf cgroup of its own under the cgroup v2 directory DIR and report
+ *                              its peak memory when it finishes
+ *               --cgroup-memory SIZE - memory.max of each --cgroup leaf, in bytes or with a K, M or G suffix
+ *               --cgroup-cpu PERCENT - cpu.max of each --cgroup leaf, as a percentage of one CPU
+ *               --history FILE - keep the history of lines read from stdin in FILE (a terminal uses $HISTFILE or
+ *                                ~/.smallsh_history without it)
+ *               --serve SOCK - answer command lines sent to the Unix socket SOCK, one shell per connection
+ *               --client SOCK - send the lines of the input file (or stdin) to a --serve socket and print the replies
+ *               --load-test N - with --client, send N requests of the command given as argument (default true) over
+ *                               -j connections (default 1) and report requests/s and latencies
  * @return - 0 if executed without error, else exit with error code
  */
 int main(int argc, char *argv[]) {
     // init program vars
-    struct sh_options *opts = malloc(sizeof(struct sh_options));
+    struct sh_options *opts = calloc(1, sizeof(struct sh_options));
     opts->exit_status = 0;        // exit status of last exited process
     opts->parent_pid = getpid();  // parent process pid
     opts->process_pid = -5;       // last child process pid
     opts->background_pid = 0;     // last background process pid
     opts->child_status = -5;      // exit status of the last child process
     opts->interactive = 1;        // indicates if reading from stdin or file
-    for (int i = 0; i < 10; i++) {  // array of all background processes
-        opts->background_pids[i] = -1;
+    opts->jobs = (struct job_table) {.watch_fd = -1};  // table of all background processes
+    opts->exiting = 0;            // set by exit, which leaves through the cleanup below
+    opts->acct_fd = -1;           // accounting log, if any
+    opts->cgroup_fd = -1;         // --cgroup directory, if any
+    opts->history.fd = -1;        // history file, if any
+    var_init(&opts->vars);        // shell variables, starting with the environment
+    char const *line = NULL;
+    char *bench_workload = NULL;
+    struct bench bench_state = {.iterations = 10};
+    FILE *bench_out = NULL;
+    char *serve_path = NULL, *client_path = NULL;
+    long load_requests = 0;
+    char *metrics_path = NULL;
+    int metrics_json = 0, metrics_interval = 10;
+    char *cgroup_dir = NULL, *history_path = NULL;
+
+    // get options
+    static struct option const long_opts[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"ordered", no_argument, NULL, 'o'},
+        {"bench", required_argument, NULL, 'B'},
+        {"bench-iterations", required_argument, NULL, 'I'},
+        {"bench-format", required_argument, NULL, 'F'},
+        {"acct", required_argument, NULL, 'A'},
+        {"serve", required_argument, NULL, 'S'},
+        {"client", required_argument, NULL, 'C'},
+        {"load-test", required_argument, NULL, 'L'},
+        {"jobs-max", required_argument, NULL, 'M'},
+        {"metrics", required_argument, NULL, 'm'},
+        {"metrics-format", required_argument, NULL, 'f'},
+        {"metrics-interval", required_argument, NULL, 'i'},
+        {"cgroup", required_argument, NULL, 'g'},
+        {"cgroup-memory", required_argument, NULL, 'r'},
+        {"cgroup-cpu", required_argument, NULL, 'c'},
+        {"history", required_argument, NULL, 'H'},
+        {NULL, 0, NULL, 0}
+    };
+    for (int opt; (opt = getopt_long(argc, argv, "+j:o", long_opts, NULL)) != -1; ) {
+        switch (opt) {
+            case 'A':
+                opts->acct_fd = open(optarg, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+                if (opts->acct_fd == -1) err(1, "%s", optarg);
+                break;
+            case 'B':
+                bench_workload = optarg;
+                break;
+            case 'I':
+                bench_state.iterations = (int) strtol(optarg, NULL, 10);
+                if (bench_state.iterations < 1) errx(1, "invalid iteration count: %s", optarg);
+                break;
+            case 'F':
+                if (strcmp("json", optarg) == 0) bench_state.json = 1;
+                else if (strcmp("csv", optarg) != 0) errx(1, "invalid bench format: %s", optarg);
+                break;
+            case 'j':
+                opts->batch.max_jobs = (int) strtol(optarg, NULL, 10);
+                if (opts->batch.max_jobs < 1) errx(1, "invalid job count: %s", optarg);
+                break;
+            case 'o':
+                opts->batch.ordered = 1;
+                break;
+            case 'S':
+                serve_path = optarg;
+                break;
+            case 'C':
+                client_path = optarg;
+                break;
+            case 'M':
+                opts->jobs.max_running = (int) strtol(optarg, NULL, 10);
+                if (opts->jobs.max_running < 0) errx(1, "invalid job limit: %s", optarg);
+                break;
+            case 'm':
+                metrics_path = optarg;
+                break;
+            case 'f':
+                if (strcmp("json", optarg) == 0) metrics_json = 1;
+                else if (strcmp("prometheus", optarg) != 0) errx(1, "invalid metrics format: %s", optarg);
+                break;
+            case 'i':
+                metrics_interval = (int) strtol(optarg, NULL, 10);
+                if (metrics_interval < 0) errx(1, "invalid metrics interval: %s", optarg);
+                break;
+            case 'g':
+                cgroup_dir = optarg;
+                break;
+            case 'H':
+                history_path = optarg;
+                break;
+            case 'r': {
+                char *end;
+                unsigned long long bytes = strtoull(optarg, &end, 10);
+                int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+                if (end == optarg || end[shift > 0] != '\0' || bytes == 0 || bytes > ULLONG_MAX >> shift) {
+                    errx(1, "invalid cgroup memory limit: %s", optarg);
+                }
+                free(opts->cgroup_memory);
+                if (asprintf(&opts->cgroup_memory, "%llu", bytes << shift) == -1) err(1, "asprintf");
+                break;
+            }
+            case 'c': {
+                long percent = strtol(optarg, NULL, 10);
+                if (percent < 1) errx(1, "invalid cgroup cpu limit: %s", optarg);
+                free(opts->cgroup_cpu);
+                if (asprintf(&opts->cgroup_cpu, "%ld 100000", percent * 1000) == -1) err(1, "asprintf");
+                break;
+            }
+            case 'L':
+                load_requests = strtol(optarg, NULL, 10);
+                if (load_requests < 1) errx(1, "invalid request count: %s", optarg);
+                break;
+            default:
+                exit(1);
+        }
+    }
+
+    // command server and its client - neither reads commands itself
+    if (serve_path != NULL || client_path != NULL || load_requests > 0) {
+        if (serve_path != NULL && client_path != NULL) errx(1, "--serve and --client are exclusive");
+        if (bench_workload != NULL) errx(1, "--bench takes no --serve or --client");
+        if (load_requests > 0 && client_path == NULL) errx(1, "--load-test needs --client");
+    }
+    if (metrics_path != NULL) metrics_init(metrics_path, metrics_json, metrics_interval);
+    if (cgroup_dir != NULL) cgroup_init(opts, cgroup_dir);
+    else if (opts->cgroup_memory != NULL || opts->cgroup_cpu != NULL) {
+        errx(1, "--cgroup-memory and --cgroup-cpu need --cgroup");
+    }
+    if (serve_path != NULL) {
+        if (argc > optind || opts->batch.max_jobs > 0) errx(1, "--serve takes no script file or -j");
+        opts->interactive = 0;
+        serve(opts, serve_path);
+    }
+    if (load_requests > 0) {
+        if (argc - optind > 1) errx(1, "too many arguments");
+        int connections = opts->batch.max_jobs > 0 ? opts->batch.max_jobs : 1;
+        exit(serve_load(client_path, argc > optind ? argv[optind] : "true", load_requests, connections));
+    }
+    if (client_path != NULL) {
+        if (argc - optind > 1 || opts->batch.max_jobs > 0) errx(1, "--client takes one input file and no -j");
+        FILE *input = argc > optind ? fopen(argv[optind], "re") : stdin;
+        if (input == NULL) err(1, "%s", argv[optind]);
+        exit(serve_client(client_path, input));
     }
-    char *line = NULL;
-    size_t n = 0;
 
     // get input
     opts->input = stdin;
-    if (argc == 2) {
-        char *input_fn = argv[1];
+    if (argc - optind == 1) {
+        char *input_fn = argv[optind];
         opts->input = fopen(input_fn, "re");  // e flag for cloexec
         if (opts->input == NULL) {
             fprintf(stderr, "Error opening file %s\n", input_fn);
+            exit(1);
         } else opts->interactive = 0;
-    } else if (argc > 2) {
+        // regular files are read in place, pipes and FIFOs keep streaming through getline
+        map_script(opts);
+    } else if (argc - optind > 1) {
         errx(1, "too many arguments");
     }
+    if (opts->batch.max_jobs > 0 && opts->interactive) errx(1, "-j needs a script file");
+
+    // benchmark - the workload's own output is discarded, the report goes to the real stdout
+    if (bench_workload != NULL) {
+        if (opts->batch.max_jobs > 0 || !opts->interactive) errx(1, "--bench takes no script file or -j");
+        opts->input = bench_open(bench_workload);
+        if (opts->input == NULL) err(1, "%s", bench_workload);
+        opts->interactive = 0;
+        bench = &bench_state;
+        bench_out = fdopen(fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3), "w");
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (bench_out == NULL || null_fd == -1) err(1, "bench setup");
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+
+    // history of the lines typed in - shared with every other shell using the same file
+    if (opts->interactive == 1 && (history_path != NULL || isatty(STDIN_FILENO))) {
+        char *path = NULL;
+        char const *home = var_get(&opts->vars, "HOME");
+        if (history_path == NULL) history_path = (char *) var_get(&opts->vars, "HISTFILE");
+        if (history_path == NULL && home != NULL) {
+            if (asprintf(&path, "%s/.smallsh_history", home) == -1) err(1, "asprintf");
+            history_path = path;
+        }
+        if (history_path != NULL) history_open(&opts->history, history_path);
+        free(path);
+    }
 
     // init signal handlers and set SIGTSTP to ignore
     if (opts->interactive == 1) {
@@ -111,8 +802,8 @@ int main(int argc, char *argv[]) {
         sigfillset(&opts->sig_ignore.sa_mask);
         opts->sig_ignore.sa_flags = 0;
 
-        // sigint handler
-        opts->sigint_action.sa_handler = sigint_handler;
+        // SIGINT at the prompt - blocked, so it waits in the signalfd instead of killing the shell
+        opts->sigint_action.sa_handler = SIG_DFL;
         sigfillset(&opts->sigint_action.sa_mask);
         opts->sigint_action.sa_flags = 0;
 
@@ -120,84 +811,219 @@ int main(int argc, char *argv[]) {
         sigaction(SIGTSTP, &opts->sig_ignore, &opts->sigtstp_saved);  // save starting state for sigtstp
         sigaction(SIGINT, &opts->sigint_action, &opts->sigint_saved); // save starting state for sigint
 
+        // job control - every pipeline gets its own process group and the terminal while in the foreground, so the
+        // shell ignores SIGTTOU to take the terminal back
+        opts->job_control = 1;
+        opts->shell_pgid = getpgrp();
+        sigaction(SIGTTOU, &opts->sig_ignore, &opts->sigttou_saved);
     }
 
+    // children and ^C are noticed through epoll as they happen
+    events_init(opts);
+
     // loop for reading lines from input source
     while (1) {
         start:
         fflush(stdout);
-        opts->index = 0;
-        opts->n_words = 0;
 
-        // Manage background processes
-        manage_background(opts);
+        // report background jobs that finished while the last line ran - at the prompt they are reported the moment
+        // they finish; batch workers are reaped by the batch scheduler
+        if (opts->jobs.len > 0) wait_events(opts, 0);
+        job_queue_run(opts);
 
         // prompt in interactive mode
         if (opts->interactive == 1) {
             print_prompt(opts);
         }
 
-        // ignore SIGINT signals while reading next line
+        // accept SIGINT (through the signalfd) while reading next line
         if (opts->interactive == 1) sigaction(SIGINT, &opts->sigint_action, NULL);
 
-        // getline from input source
-        ssize_t line_len = getline(&line, &n, opts->input);
-        if (line_len == -1) {
-            if (feof(opts->input)) {
-                break;
-            } else if (errno == EINTR && opts->interactive == 1) {
-                // reset errors if signals interfere with getline
-                errno = 0;
-                fprintf(stderr, "\n");
-                clearerr(stdin);
-                opts->error = 1;
-            } else {
-                //fprintf(stderr, "Error reading from getline\n");
-                opts->error = 1;
-            }
-        }
+        // read line from input source
+        uint64_t phase_start = bench_now();
+        opts->queue_safe = 1;
+        ssize_t line_len = read_line(opts, &line);
+        opts->queue_safe = 0;
 
-        // set SIGINT to ignore
+        // set SIGINT to ignore - this also discards a ^C pending since the line was read
         if (opts->interactive == 1) sigaction(SIGINT, &opts->sig_ignore, NULL);
 
-        // restart if error
+        // restart if interrupted
         if (opts->error == 1) {
             opts->error = 0;
             goto start;
         }
+        if (line_len == -1) {
+            if (bench && bench_rewind(opts)) goto start;
+            break;
+        }
+
+        bench_record(BENCH_GETLINE, phase_start);
 
-        // split input into words, expand, parse, and execute (within parse)
-        opts->n_words = wordsplit(line);
-        for (size_t i = 0; i < opts->n_words; ++i) {
-            //fprintf(stderr, "Word %zu: %s\n", i, words[i]);
-            char *exp_word = expand(words[i], opts);
-            free(words[i]);
-            words[i] = exp_word;
-            //fprintf(stderr, "Expanded Word %zu: %s\n", i, words[i]);
+        // history events are replaced ahead of wordsplit, and the line is kept as it runs
+        if (opts->history.fd != -1) {
+            size_t len = (size_t) line_len;
+            line = history_expand(opts, line, &len);
+            history_add(&opts->history, line, len);
+            line_len = (ssize_t) len;
         }
-        parse_words(opts);
+        run_line(opts, line, line_len);
+        if (opts->exiting) break;
     }
 
     // EXIT INPUT LOOP AND CLEANUP - close files, kill processes, free memory
+    // exit drained the batch before it ran and set $? itself
+    if (opts->batch.max_jobs > 0) {
+        if (!opts->exiting) batch_drain(opts);
+        free(opts->batch.queue);
+    }
+    metrics_dump(opts);
     if (opts->input != stdin) fclose(opts->input);
+    if (opts->map) munmap(opts->map, opts->map_size);
+    free(opts->line_buf);
+    if (bench) {
+        bench_report(bench_out, bench_workload);
+        fclose(bench_out);
+    }
     int exit_status = opts->exit_status;
-    for (int j = 0; j < 10; j++) {
-        if (opts->background_pids[j] != -1) {
-            kill(opts->background_pids[j], 2);
-        }
+    for (size_t j = 0; j < opts->jobs.len; j++) {
+        kill(opts->jobs.jobs[j].pid, SIGINT);
     }
+    job_table_free(&opts->jobs);
+    if (opts->cgroup_fd != -1) {
+        cgroup_sweep(opts);
+        close(opts->cgroup_fd);
+    }
+    for (size_t s = 0; s < opts->n_cgroup_stale; s++) free(opts->cgroup_stale[s]);
+    free(opts->cgroup_stale);
+    free(opts->cgroup_memory);
+    free(opts->cgroup_cpu);
+    history_close(&opts->history);
+    close(opts->epoll_fd);
+    close(opts->signal_fd);
+    path_cache_clear(&opts->paths);
+    free(opts->paths.entries);
+    free(opts->paths.path_env);
+    var_table_free(&opts->vars);
     //fprintf(stderr, "Child count: %d\n", opts->children);
     free(opts);
+    for (struct arena_block *b = line_arena.head, *next; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    for (struct arena_block *b = block_arena.head, *next; b; b = next) {
+        next = b->next;
+        free(b);
+    }
     exit(exit_status);
 }
 
 /**
- * Empty signal handler for handling signals during command line input
+ * Splits input into words, expands, parses, and executes (within parse) one line - for the main loop and for every
+ * line of a --serve connection
+ */
+void run_line(struct sh_options *opts, char const *line, size_t line_len) {
+    opts->index = 0;
+    opts->n_words = 0;
+    arena_reset(&line_arena);
+    metrics_line(opts);
+
+    uint64_t phase_start = bench_now();
+    opts->n_words = wordsplit(line, line_len);
+    bench_record(BENCH_WORDSPLIT, phase_start);
+    read_heredocs(opts);
+    // for/while/if read the rest of the block and run it compiled - a barrier for -j
+    if (opts->n_words > 0 && block_keyword(words[0])) {
+        if (opts->batch.max_jobs > 0) batch_drain(opts);
+        run_block(opts);
+        return;
+    }
+    if (opts->batch.max_jobs > 0 && batch_dispatch(opts)) return;
+    phase_start = bench_now();
+    expand_words(opts);
+    bench_record(BENCH_EXPAND, phase_start);
+    parse_words_timed(opts);
+}
+
+/**
+ * Runs parse_words, timing it for --bench and --metrics without the spawns and waits it started
+ */
+void parse_words_timed(struct sh_options *opts) {
+    uint64_t phase_start = bench_now();
+    if (bench) bench->exec_ns = 0;
+    uint64_t exec_ns = metrics->phase_ns[BENCH_SPAWN] + metrics->phase_ns[BENCH_WAIT];
+    parse_words(opts);
+    if (bench) bench_sample(BENCH_PARSE, bench_now() - phase_start - bench->exec_ns);
+    if (metrics_timing) {
+        exec_ns = metrics->phase_ns[BENCH_SPAWN] + metrics->phase_ns[BENCH_WAIT] - exec_ns;
+        METRIC_ADD(phase_ns[BENCH_PARSE], (bench_now() - phase_start) * METRICS_SAMPLE - exec_ns);
+    }
+}
+
+// GLOBAL words vector - entries point into line_arena, grown to the longest line seen
+char **words = NULL;
+size_t words_cap = 0;
+struct arena line_arena = {0};
+// compiled for/while/if blocks - released when the outermost block is done
+struct arena block_arena = {0};
+
+/**
+ * Makes room for n words, doubling the vector - the words already split are kept
+ */
+void words_reserve(size_t n) {
+    if (n <= words_cap) return;
+    size_t cap = words_cap ? words_cap : 64;
+    while (cap < n) cap *= 2;
+    char **tmp = realloc(words, sizeof *words * cap);
+    if (!tmp) err(1, "realloc");
+    words = tmp;
+    words_cap = cap;
+}
+
+/**
+ * Allocates n bytes from the arena, chaining a new block (at least double the last one) when the current one is full
  */
-void sigint_handler (int sig) {};
+void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + 15) & ~(size_t) 15;
+    struct arena_block *b = a->cur;
+    // reuse blocks kept from before the last reset
+    while (b && b->cap - b->used < n && b->next) {
+        b = b->next;
+        b->used = 0;
+    }
+    if (!b || b->cap - b->used < n) {
+        size_t cap = b ? b->cap * 2 : 4096;
+        while (cap < n) cap *= 2;
+        struct arena_block *nb = malloc(sizeof *nb + cap);
+        if (!nb) err(1, "malloc");
+        nb->next = NULL;
+        nb->cap = cap;
+        nb->used = 0;
+        if (b) b->next = nb;
+        else a->head = nb;
+        b = nb;
+    }
+    a->cur = b;
+    void *ret = b->data + b->used;
+    b->used += n;
+    return ret;
+}
+
+/**
+ * Copies a string into the arena
+ */
+char *arena_strdup(struct arena *a, char const *s) {
+    size_t n = strlen(s) + 1;
+    return memcpy(arena_alloc(a, n), s, n);
+}
 
-// GLOBAL words array
-char *words[MAX_WORDS] = {0};
+/**
+ * Releases everything allocated from the arena at once - blocks are kept for the next line
+ */
+void arena_reset(struct arena *a) {
+    a->cur = a->head;
+    if (a->cur) a->cur->used = 0;
+}
 
 /**
  * Prints command line prompt during interactive mode
@@ -206,7 +1032,7 @@ int print_prompt (struct sh_options *opts) {
     if (opts->input == stdin) {
         uid_t user = getuid();
         uid_t euser = getegid();
-        char *PSx = getenv("PS1");
+        char const *PSx = var_get(&opts->vars, "PS1");
         if (PSx != NULL) fprintf(stderr, "%s", PSx);
         else {
             if (user == euser) fprintf(stderr, "%s", "$ ");
@@ -217,408 +1043,5161 @@ int print_prompt (struct sh_options *opts) {
 }
 
 /**
- * Manages the statuses of background processes and prints/resumes their statuses
+ * Home slot of a pid in the job map - n_slots is always a power of two
  */
-int manage_background (struct sh_options *opts) {
-    /* check background process */
-
-    opts->process_pid = waitpid(0, &opts->child_status, WNOHANG | WUNTRACED);
+static size_t job_hash(struct job_table *t, pid_t pid) {
+    return ((uint32_t) pid * 2654435761u) & (t->n_slots - 1);
+}
 
-    /* if process exited */
-    if (WIFEXITED(opts->child_status) && opts->process_pid > 0) {
-        int exit_status = WEXITSTATUS(opts->child_status);
-        fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t) opts->process_pid, exit_status);
-    }
-    /* process is signaled */
-    if (WIFSIGNALED(opts->child_status)  && opts->process_pid > 0)  {
-        int signal_num = WTERMSIG(opts->child_status);
-        fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t) opts->process_pid, signal_num);
-    }
-    /* process is stopped */
-    if (WIFSTOPPED(opts->child_status) && opts->process_pid > 0) {
-        kill(opts->process_pid, SIGCONT);
-        fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) opts->process_pid);
+/**
+ * Returns the map slot holding pid, or the empty slot where it would go
+ */
+static size_t *job_slot(struct job_table *t, pid_t pid) {
+    size_t h = job_hash(t, pid);
+    while (t->slots[h] != 0 && t->jobs[t->slots[h] - 1].pid != pid) {
+        h = (h + 1) & (t->n_slots - 1);
     }
-    return 0;
+    return &t->slots[h];
 }
 
 /**
- * For EACH command line: execute built-in commands exit or cd, parse other commands into an executable array or a
- * file re-direciton array (re-direction happens within the child process), and determine if command is run in the
- * background. Send the commands for execution.
+ * Adds a background process to the job table under job id (0 takes the next free id) - the returned entry is valid
+ * until the table next changes
  */
-int parse_words(struct sh_options *opts) {
-    int exec_len = 0, redir_len = 0, background = 0, reset = 0;
-    char *exec_arr[MAX_WORDS] = {0};
-    char *redir_arr[MAX_WORDS] = {0};
-    for (int i = 0; i < opts->n_words; i++) {
-        /* init new loop vars */
-        int next = i <= opts->n_words ? 1 : 0;
-        char *word = words[i];
-
-        // exit PARENT process
-        if (strcmp("exit", word) == 0) {
-            exit_pgm(i, opts);
+struct job *job_add(struct job_table *t, pid_t pid, int id) {
+    // grow the array and rebuild the map at 50% load
+    if (t->len == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 16;
+        void *tmp = realloc(t->jobs, sizeof *t->jobs * cap);
+        if (!tmp) err(1, "realloc");
+        t->jobs = tmp;
+        t->cap = cap;
+        free(t->slots);
+        t->n_slots = cap * 2;
+        t->slots = calloc(t->n_slots, sizeof *t->slots);
+        if (!t->slots) err(1, "calloc");
+        for (size_t i = 0; i < t->len; i++) {
+            *job_slot(t, t->jobs[i].pid) = i + 1;
         }
+    }
+    // queued lines hold their job numbers, so numbering only starts over once nothing is running or queued
+    if (t->len == 0 && t->queue_len == 0 && id == 0) t->next_id = 1;
+    if (id >= t->next_id) t->next_id = id + 1;
+    struct job *job = &t->jobs[t->len];
+    *job = (struct job) {.pid = pid, .id = id ? id : t->next_id++, .pidfd = -1, .timer_fd = -1};
+    *job_slot(t, pid) = ++t->len;
 
-        // change directories in the PARENT process
-        else if (strcmp("cd", word) == 0) {
-            change_dir(i, opts);
-            i++;
-            return 0;
+    // the pidfd turns readable the moment the process exits - without one (old kernels) SIGCHLD still reaps it
+    if (t->watch_fd != -1) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.u64 = WATCH_KEY(WATCH_JOB, pid)};
+        job->pidfd = pidfd_open(pid, 0);
+        if (job->pidfd != -1 && epoll_ctl(t->watch_fd, EPOLL_CTL_ADD, job->pidfd, &ev) == -1) {
+            close(job->pidfd);
+            job->pidfd = -1;
+        }
+    }
+    return job;
+}
 
-        // detect file redirection commands and write to a redirect array
-        } else if ((strcmp("<", word) == 0) || (strcmp(">", word) == 0) || (strcmp(">>", word) == 0)) {
-            if (!next) {
-                fprintf(stderr, "Invalid file redirect - no file argument.");
-                exit(1);
-            } else {
-                redir_arr[redir_len] = words[i]; // save redirect symbol
-                redir_arr[redir_len + 1] = words[i  + 1]; // save redirect file
-                redir_len += 2;
-                i++;
-            }
+/**
+ * Looks up a live job by pid, NULL if it is not in the table
+ */
+struct job *job_find(struct job_table *t, pid_t pid) {
+    if (t->len == 0) return NULL;
+    size_t idx = *job_slot(t, pid);
+    return idx ? &t->jobs[idx - 1] : NULL;
+}
 
-        // detect if a background command
-        } else if (strcmp("&", word) == 0) {
-            background = 1;
+/**
+ * Removes a reaped process from the job table - returns 0 if it was not a background job
+ */
+int job_remove(struct job_table *t, pid_t pid) {
+    if (t->len == 0) return 0;
+    size_t *slot = job_slot(t, pid);
+    size_t idx = *slot;
+    if (idx == 0) return 0;
 
-        // add executable commands to the execute array
-        } else {
-                exec_arr[exec_len] = word;
-                exec_len++;
+    // backward shift deletion keeps every probe chain intact without tombstones
+    size_t mask = t->n_slots - 1;
+    size_t hole = slot - t->slots;
+    for (size_t h = (hole + 1) & mask; t->slots[h] != 0; h = (h + 1) & mask) {
+        size_t home = job_hash(t, t->jobs[t->slots[h] - 1].pid);
+        if (((h - home) & mask) >= ((h - hole) & mask)) {
+            t->slots[hole] = t->slots[h];
+            hole = h;
         }
+    }
+    t->slots[hole] = 0;
 
-        // execute at the end of each line
-        if (i >= opts->n_words - 1) {
-            execute(opts, exec_arr, redir_arr, redir_len, background);
-            opts->index = i;
-            reset = 1;
-        }
+    // deregister explicitly - a forked worker may still hold a copy of the pidfd
+    struct job *job = &t->jobs[idx - 1];
+    if (job->pidfd != -1) {
+        epoll_ctl(t->watch_fd, EPOLL_CTL_DEL, job->pidfd, NULL);
+        close(job->pidfd);
+    }
+    if (job->timer_fd != -1) {
+        epoll_ctl(t->watch_fd, EPOLL_CTL_DEL, job->timer_fd, NULL);
+        close(job->timer_fd);
+    }
 
-        // reset variables after each execution
-        if (reset == 1) {
-            exec_len = 0, redir_len= 0, background = 0;
-            for (int j = 0; j < MAX_WORDS; j++) {
-                exec_arr[j] = NULL;
-                redir_arr[j] = NULL;
-            }
-            reset = 0;
-        }
+    // move the last job into the freed array index
+    if (job->last) t->running--;
+    free(t->jobs[idx - 1].command);
+    free(t->jobs[idx - 1].cgroup);
+    if (idx != t->len) {
+        t->jobs[idx - 1] = t->jobs[t->len - 1];
+        *job_slot(t, t->jobs[idx - 1].pid) = idx;
     }
-    return 0;
+    t->len--;
+    return 1;
 }
 
 /**
- * Exit the parent process
+ * Frees the job table storage
  */
-void exit_pgm(size_t i, struct sh_options *opts){
-    int exit_num;
-    /* if no cmd line arg after exit use exit status of last foreground cmd */
-    if (i + 1 == opts->n_words) {
-        exit(opts->exit_status);
-        /* if more than one cmd line arg, exit with error */
-    } else if (opts->n_words > i + 2) {
-        //fprintf(stderr, "Error: More than one command line argument provided with exit.");
-        exit(1);
-    } else {
-        exit_num = (int) strtol(words[i + 1], NULL, 0);
-        //if (exit_num == 0) fprintf(stderr, "Exit argument was not a number");
-        exit(exit_num);
+void job_table_free(struct job_table *t) {
+    for (size_t i = 0; i < t->len; i++) {
+        free(t->jobs[i].command);
+        free(t->jobs[i].cgroup);
+        if (t->jobs[i].pidfd != -1) close(t->jobs[i].pidfd);
+        if (t->jobs[i].timer_fd != -1) close(t->jobs[i].timer_fd);
     }
+    for (size_t q = 0; q < t->queue_len; q++) free(t->queue[q].words);
+    free(t->jobs);
+    free(t->slots);
+    free(t->queue);
+    *t = (struct job_table) {.watch_fd = -1};
 }
 
 /**
- * Change directories in the parent process
+ * Manages the statuses of background processes and prints/resumes their statuses - run when the signalfd reports
+ * SIGCHLD. Every child that is ready is reaped in one call, so the time to clear them does not depend on how many
+ * finished; this also catches stopped children, which pidfds do not report.
+ * @return - number of children reported
  */
-int change_dir(size_t i, struct sh_options *opts) {
-    int success = 0;
-    /* if no arguments */
-    if (i == opts->n_words - 1) {
-        success = chdir(getenv("HOME"));
-        /* if one argument */
-    } else if (i + 1 == opts->n_words - 1) {
-        success = chdir(words[i + 1]);
-        /* if more than one argument */
-    } else {
-        //fprintf(stderr, "Too many change directory arguments provided");
-        exit(1);
-    }
-    if (success != 0) {
-        //fprintf(stderr, "Error changing directory");
-        exit(1);
+int manage_background (struct sh_options *opts) {
+    int reported = 0;
+
+    /* check background processes until none are ready */
+    struct rusage ru;
+    while ((opts->process_pid = wait4(-1, &opts->child_status, WNOHANG | WUNTRACED, &ru)) > 0) {
+        job_report(opts, opts->process_pid, opts->child_status, &ru);
+        reported++;
     }
-    return 0;
+    return reported;
 }
 
 /**
- * Execute the command line statement in a child process redirecting or running in the background  if requested.
- * @param opts - global data struct for file commands
- * @param exec_arr - executable command array with 0 index holding the command
- * @param redir_arr - array of redirection commands (to be executed in order)
- * @param redir_len - length of the redirection array
- * @param background - if background command is present or not
+ * Reaps the background process whose pidfd turned readable
+ * @return - 1 if it was reported, 0 if something else reaped it first
  */
-int execute(struct sh_options *opts, char* exec_arr[], char* redir_arr[], int redir_len, int background) {
-    int read_fd = -5;
-    int write_fd = -5;
-    int append_fd = -5;
-    int success = -5;
-    pid_t child_pid = -5;
-
-    child_pid = fork();
-    if (child_pid != -1) opts->children++;
-
-    // if fork failed
-    switch (child_pid) {
-        case -1:
-            //fprintf(stderr, "Error creating fork");
-            exit(1);
+int job_reap(struct sh_options *opts, pid_t pid) {
+    struct rusage ru;
+    opts->process_pid = wait4(pid, &opts->child_status, WNOHANG, &ru);
+    if (opts->process_pid <= 0) return 0;
+    job_report(opts, pid, opts->child_status, &ru);
+    return 1;
+}
 
-        // CHILD PROCESS - reset signals or original state, perform re-direction and execute command
-        case 0:
+/**
+ * Reaps the background jobs that have no pidfd (kernels before 5.3) by their pids - the -j replacement for
+ * manage_background, which would also take the batch workers
+ * @return - number of children reported
+ */
+int job_reap_unwatched(struct sh_options *opts) {
+    // job_report drops finished jobs from the table, so the pids are collected first
+    pid_t pids[opts->jobs.len + 1];
+    size_t n = 0;
+    for (size_t j = 0; j < opts->jobs.len; j++) {
+        if (opts->jobs.jobs[j].pidfd == -1) pids[n++] = opts->jobs.jobs[j].pid;
+    }
 
-            // reset all signals
-            sigaction(SIGINT, &opts->sigint_saved, NULL);
-            sigaction(SIGTSTP, &opts->sigtstp_saved, NULL);
+    int reported = 0;
+    struct rusage ru;
+    for (size_t p = 0; p < n; p++) {
+        opts->process_pid = wait4(pids[p], &opts->child_status, WNOHANG | WUNTRACED, &ru);
+        if (opts->process_pid <= 0) continue;
+        job_report(opts, pids[p], opts->child_status, &ru);
+        reported++;
+    }
+    return reported;
+}
 
-            // perform file redirection
-            if (redir_arr[0] != NULL) {
-                for (int r = 0; r < redir_len; r++) {
-                    if (strcmp("<", redir_arr[r]) == 0) {
-                        // open for reading
-                        read_fd = open(redir_arr[r + 1], O_RDONLY);
-                        if (read_fd == -1) {
-                            //fprintf(stderr, "Error opening file for reading: %s \n", read);
-                            exit(1);
-                        }
-                        // redirect to stdin
-                        success = dup2(read_fd, STDIN_FILENO);
-                        if (success == -1) {
-                            //fprintf(stderr, "Error redirecting file for reading: %s \n", read);
-                            exit(1);
-                        }
-                        r++;
-
-                    } else if (strcmp(">", redir_arr[r]) == 0) {
-                        // open for writing
-                        write_fd = open(redir_arr[r + 1], O_WRONLY | O_CREAT | O_TRUNC, 0777);
-                        if (write_fd == -1) {
-                            //fprintf(stderr, "Error opening file for writing %s \n", write);
-                            exit(1);
-                        }
-                        // redirect to stdout
-                        success = dup2(write_fd, STDOUT_FILENO);
-                        if (success == -1) {
-                            //fprintf(stderr, "Error redirecting file for writing %s \n", write);
-                            exit(1);
+/**
+ * Prints the new state of a child, accounts for a finished job and drops it, and continues a stopped one
+ */
+void job_report(struct sh_options *opts, pid_t pid, int status, struct rusage *ru) {
+    /* if process exited */
+    if (WIFEXITED(status)) {
+        fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t) pid, WEXITSTATUS(status));
+    }
+    /* process is signaled */
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t) pid, WTERMSIG(status));
+    }
+    /* account for the finished job and drop it */
+    struct job *job = job_find(&opts->jobs, pid);
+    if (job && !WIFSTOPPED(status)) {
+        int exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status) + 128;
+        // timed out - 124 like timeout(1), or 137 if it took SIGKILL
+        if (job->timed_out) exit_status = job->timed_out == 1 ? 124 : 128 + SIGKILL;
+        if (job->cgroup) cgroup_finish(opts, job->cgroup, pid, ru->ru_maxrss);
+        // for wait - the process or job it is after, and wait -n
+        if (pid == opts->jobs.wait_pid || (job->last && job->id == opts->jobs.wait_id)) {
+            opts->jobs.wait_status = exit_status;
+        }
+        if (job->last) {
+            opts->jobs.finished++;
+            opts->jobs.last_status = exit_status;
+            METRIC_ADD(jobs_finished, 1);
+            if (opts->jobs.wake_ns) {
+                uint64_t ns = monotonic_ns() - opts->jobs.wake_ns;
+                METRIC_ADD(reap_ns, ns);
+                METRIC_MAX(reap_max_ns, ns);
+            }
+        }
+        uint64_t wall_ns = monotonic_ns() - job->start_ns;
+        acct_record(opts, job->pid, exit_status, wall_ns, ru, job->command);
+        if (job->timed) time_report(wall_ns, ru);
+        job_remove(&opts->jobs, pid);
+    }
+    /* process is stopped */
+    if (WIFSTOPPED(status)) {
+        kill(pid, SIGCONT);
+        fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) pid);
+    }
+}
+
+/**
+ * Heap order of the background queue - higher $JOB_PRIORITY first, then first queued
+ */
+static bool job_queue_before(struct queued_job const *a, struct queued_job const *b) {
+    return a->priority != b->priority ? a->priority > b->priority : a->seq < b->seq;
+}
+
+/**
+ * Queues the parsed background line while every jobs-max slot is taken - the words are copied into one allocation
+ * (here-document operators stay the shared sentinels) and the line gets its job number now, so wait %N and jobs work
+ * before it starts
+ */
+void job_queue_add(struct sh_options *opts) {
+    struct job_table *t = &opts->jobs;
+    size_t n = opts->n_words, size = sizeof(char *) * n;
+    for (size_t w = 0; w < n; w++) size += strlen(words[w]) + 1;
+    struct queued_job q = {.n_words = n, .seq = t->queue_seq++, .words = malloc(size)};
+    if (!q.words) err(1, "malloc");
+    char *text = (char *) (q.words + n);
+    for (size_t w = 0; w < n; w++) {
+        if (words[w] == heredoc_word || words[w] == heredoc_raw_word) {
+            q.words[w] = words[w];
+            continue;
+        }
+        q.words[w] = strcpy(text, words[w]);
+        text += strlen(text) + 1;
+    }
+    char const *priority = var_get(&opts->vars, "JOB_PRIORITY");
+    q.priority = priority ? (int) strtol(priority, NULL, 10) : 0;
+    if (t->len == 0 && t->queue_len == 0) t->next_id = 1;
+    q.id = t->next_id++;
+
+    if (t->queue_len == t->queue_cap) {
+        t->queue_cap = t->queue_cap ? t->queue_cap * 2 : 64;
+        void *tmp = realloc(t->queue, sizeof *t->queue * t->queue_cap);
+        if (!tmp) err(1, "realloc");
+        t->queue = tmp;
+    }
+    // sift up
+    size_t h = t->queue_len++;
+    for (; h > 0 && job_queue_before(&q, &t->queue[(h - 1) / 2]); h = (h - 1) / 2) t->queue[h] = t->queue[(h - 1) / 2];
+    t->queue[h] = q;
+    opts->exit_status = 0;
+}
+
+/**
+ * Starts queued lines while jobs-max slots are free - only called between lines or from wait, since the line is
+ * parsed again through the global words
+ */
+void job_queue_run(struct sh_options *opts) {
+    struct job_table *t = &opts->jobs;
+    while (t->queue_len > 0 && (t->max_running == 0 || t->running < t->max_running)) {
+        struct queued_job q = t->queue[0];
+        // sift the last entry down from the root
+        struct queued_job last = t->queue[--t->queue_len];
+        size_t h = 0;
+        for (size_t c; (c = 2 * h + 1) < t->queue_len; h = c) {
+            if (c + 1 < t->queue_len && job_queue_before(&t->queue[c + 1], &t->queue[c])) c++;
+            if (!job_queue_before(&t->queue[c], &last)) break;
+            t->queue[h] = t->queue[c];
+        }
+        if (t->queue_len > 0) t->queue[h] = last;
+
+        words_reserve(q.n_words);
+        memcpy(words, q.words, sizeof *words * q.n_words);
+        opts->n_words = q.n_words;
+        t->launch_id = q.id;
+        parse_words(opts);
+        t->launch_id = 0;
+        free(q.words);
+    }
+}
+
+/**
+ * The jobs-max built-in in the parent process: "jobs-max N" lets at most N background pipelines run at once (0 for no
+ * limit) and queues the rest, "jobs-max" prints the limit
+ */
+int jobs_max_builtin(size_t i, struct sh_options *opts) {
+    opts->exit_status = 0;
+    if (i + 1 == opts->n_words) {
+        printf("%d\n", opts->jobs.max_running);
+        fflush(stdout);
+        return 0;
+    }
+    char *end;
+    long max = strtol(words[i + 1], &end, 10);
+    if (*end != '\0' || end == words[i + 1] || max < 0 || max > INT_MAX || i + 2 < opts->n_words) {
+        fprintf(stderr, "jobs-max: usage: jobs-max [N]\n");
+        opts->exit_status = 1;
+        return 1;
+    }
+    opts->jobs.max_running = (int) max;
+    return 0;
+}
+
+/**
+ * Orders running processes by job number for jobs
+ */
+static int job_cmp(void const *a, void const *b) {
+    struct job const *x = *(struct job *const *) a, *y = *(struct job *const *) b;
+    if (x->id != y->id) return (x->id > y->id) - (x->id < y->id);
+    return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+/**
+ * Orders queued lines the way they will start, for jobs
+ */
+static int queued_job_cmp(void const *a, void const *b) {
+    return job_queue_before(a, b) ? -1 : job_queue_before(b, a);
+}
+
+/**
+ * The jobs built-in in the parent process: one line per running background process, then the queued lines in the
+ * order they will start
+ */
+int jobs_builtin(size_t i, struct sh_options *opts) {
+    (void) i;
+    struct job_table *t = &opts->jobs;
+    struct job **running = arena_alloc(&line_arena, sizeof *running * (t->len + 1));
+    for (size_t j = 0; j < t->len; j++) running[j] = &t->jobs[j];
+    qsort(running, t->len, sizeof *running, job_cmp);
+    for (size_t j = 0; j < t->len; j++) {
+        printf("[%d] %jd Running %s\n", running[j]->id, (intmax_t) running[j]->pid,
+               running[j]->command ? running[j]->command : "");
+    }
+
+    struct queued_job *queued = arena_alloc(&line_arena, sizeof *queued * (t->queue_len + 1));
+    if (t->queue_len > 0) memcpy(queued, t->queue, sizeof *queued * t->queue_len);
+    // a sorted copy - the heap itself is left alone
+    qsort(queued, t->queue_len, sizeof *queued, queued_job_cmp);
+    for (size_t q = 0; q < t->queue_len; q++) {
+        printf("[%d] - Queued", queued[q].id);
+        for (size_t w = 0; w + 1 < queued[q].n_words; w++) printf(" %s", queued[q].words[w]);
+        printf("\n");
+    }
+    fflush(stdout);
+    opts->exit_status = 0;
+    return 0;
+}
+
+/**
+ * Whether the job wait is after is still running or queued
+ */
+static bool job_waiting(struct job_table *t, pid_t pid, int id) {
+    if (pid != 0) return job_find(t, pid) != NULL;
+    for (size_t j = 0; j < t->len; j++) {
+        if (t->jobs[j].id == id) return true;
+    }
+    for (size_t q = 0; q < t->queue_len; q++) {
+        if (t->queue[q].id == id) return true;
+    }
+    return false;
+}
+
+/**
+ * Runs queued lines and handles events until the target is done - a process (pid), a job (id), the next pipeline to
+ * finish (next) or, with none of them, every job
+ * @return - exit status of the target (0 for every job), -1 if ^C stopped the wait
+ */
+static int wait_until(struct sh_options *opts, pid_t pid, int id, int next) {
+    struct job_table *t = &opts->jobs;
+    int finished = t->finished;
+    t->wait_pid = pid;
+    t->wait_id = id;
+    t->wait_status = 0;
+    int status = 0;
+    while (1) {
+        job_queue_run(opts);
+        bool done = next ? t->finished != finished
+                  : pid != 0 || id != 0 ? !job_waiting(t, pid, id)
+                  : t->len == 0 && t->queue_len == 0;
+        if (done) break;
+        if (wait_events(opts, -1) & EVENT_INTERRUPT) {
+            status = -1;
+            break;
+        }
+    }
+    if (status == 0) status = next ? t->last_status : pid != 0 || id != 0 ? t->wait_status : 0;
+    t->wait_pid = 0;
+    t->wait_id = 0;
+    return status;
+}
+
+/**
+ * The wait built-in in the parent process - "wait" returns once every background job (queued ones included) is done,
+ * "wait PID|%N..." once each of them is, with the exit status of the last, and "wait -n" once the next job finishes.
+ * Queued lines keep starting meanwhile; the shell sleeps in epoll, and ^C at a terminal stops waiting.
+ */
+int wait_builtin(size_t i, struct sh_options *opts) {
+    struct job_table *t = &opts->jobs;
+    size_t n_args = opts->n_words - i - 1;
+    // the targets are read first - starting queued lines reuses words
+    pid_t *pids = arena_alloc(&line_arena, sizeof *pids * (n_args + 1));
+    int *ids = arena_alloc(&line_arena, sizeof *ids * (n_args + 1));
+    int next = n_args > 0 && strcmp("-n", words[i + 1]) == 0;
+    for (size_t a = next; a < n_args; a++) {
+        char const *arg = words[i + 1 + a], *num = arg[0] == '%' ? arg + 1 : arg;
+        char *end;
+        long value = strtol(num, &end, 10);
+        if (*end != '\0' || end == num || value <= 0 || value > INT_MAX) {
+            fprintf(stderr, "wait: `%s': not a pid or valid job spec\n", arg);
+            opts->exit_status = 2;
+            return 2;
+        }
+        pids[a] = arg[0] == '%' ? 0 : (pid_t) value;
+        ids[a] = arg[0] == '%' ? (int) value : 0;
+    }
+
+    if (opts->interactive == 1) sigaction(SIGINT, &opts->sigint_action, NULL);
+    int status = 0;
+    if (next) {
+        status = t->len == 0 && t->queue_len == 0 ? 127 : wait_until(opts, 0, 0, 1);
+    } else if (n_args == 0) {
+        status = wait_until(opts, 0, 0, 0);
+    }
+    for (size_t a = 0; !next && a < n_args && status != -1; a++) {
+        if (!job_waiting(t, pids[a], ids[a])) {
+            if (pids[a] != 0) fprintf(stderr, "wait: pid %jd is not a child of this shell\n", (intmax_t) pids[a]);
+            else fprintf(stderr, "wait: %%%d: no such job\n", ids[a]);
+            status = 127;
+            continue;
+        }
+        status = wait_until(opts, pids[a], ids[a], 0);
+    }
+    if (opts->interactive == 1) sigaction(SIGINT, &opts->sig_ignore, NULL);
+
+    if (status == -1) {
+        fprintf(stderr, "\n");
+        status = 130;
+    }
+    opts->exit_status = status;
+    return status;
+}
+
+/**
+ * Sets up the event loop - SIGCHLD (and SIGINT when interactive) are blocked and read from a signalfd, which one
+ * epoll instance watches together with stdin and the pidfd of every background process. Children get the startup
+ * signal mask back.
+ */
+void events_init(struct sh_options *opts) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (opts->interactive == 1) sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &opts->sigmask_saved);
+
+    opts->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    opts->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (opts->signal_fd == -1 || opts->epoll_fd == -1) err(1, "event loop");
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = WATCH_KEY(WATCH_SIGNALS, 0)};
+    if (epoll_ctl(opts->epoll_fd, EPOLL_CTL_ADD, opts->signal_fd, &ev) == -1) err(1, "epoll_ctl");
+
+    // commands typed or piped in - a regular file cannot be polled (EPERM) but never blocks either
+    if (opts->input == stdin && opts->map == NULL) {
+        ev.data.u64 = WATCH_KEY(WATCH_INPUT, 0);
+        opts->input_polled = epoll_ctl(opts->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+    }
+    opts->jobs.watch_fd = opts->epoll_fd;
+}
+
+/**
+ * Waits up to timeout ms (-1 forever, 0 to poll) and handles what happened - finished background jobs are reported
+ * right away, SIGINT and readable stdin are returned for read_line
+ * @return - EVENT_INPUT, EVENT_INTERRUPT and EVENT_JOBS bits
+ */
+int wait_events(struct sh_options *opts, int timeout) {
+    struct epoll_event evs[32];
+    int ready = 0, sigchld = 0;
+    int n = epoll_wait(opts->epoll_fd, evs, sizeof evs / sizeof evs[0], timeout);
+    opts->jobs.wake_ns = metrics->timing ? monotonic_ns() : 0;
+
+    for (int e = 0; e < n; e++) {
+        uint64_t key = evs[e].data.u64;
+        switch (key >> 32) {
+            case WATCH_INPUT:
+                ready |= EVENT_INPUT;
+                break;
+            case WATCH_SIGNALS: {
+                struct signalfd_siginfo si;
+                while (read(opts->signal_fd, &si, sizeof si) == sizeof si) {
+                    if (si.ssi_signo == SIGINT) ready |= EVENT_INTERRUPT;
+                    if (si.ssi_signo == SIGCHLD) sigchld = 1;
+                }
+                break;
+            }
+            case WATCH_JOB:
+                if (job_reap(opts, (pid_t) (uint32_t) key)) ready |= EVENT_JOBS;
+                break;
+            case WATCH_TIMER:
+                job_timeout(opts, (pid_t) (uint32_t) key);
+                break;
+        }
+    }
+    if (sigchld || opts->sigchld) {
+        // under -j a wait for any child would take the batch workers from batch_reap, so only the jobs without a
+        // pidfd are waited for there, each by its pid
+        int reported = opts->batch.max_jobs == 0 ? manage_background(opts) : job_reap_unwatched(opts);
+        if (reported > 0) ready |= EVENT_JOBS;
+    }
+    opts->sigchld = 0;
+    opts->jobs.wake_ns = 0;
+    if (metrics_due) metrics_dump(opts);
+    return ready;
+}
+
+/**
+ * For EACH command line: execute built-in commands exit or cd, parse other commands into an executable array or a
+ * file re-direciton array (re-direction happens within the child process), and determine if command is run in the
+ * background. Commands joined by | become the stages of one pipeline. Send the commands for execution.
+ */
+int parse_words(struct sh_options *opts) {
+    int exec_len = 0, redir_len = 0, background = 0, n_stages = 0, timed = 0;
+    struct parent_builtin const *parent = NULL;
+    // sized to the line from line_arena - every word adds at most one argument (or NULL between stages), two
+    // redirections (&>) or one stage, and nothing needs clearing since each stage is NULL terminated on the way
+    size_t n = opts->n_words;
+    char **exec_arr = arena_alloc(&line_arena, sizeof *exec_arr * (n + 1));
+    struct redir *redirs = arena_alloc(&line_arena, sizeof *redirs * 2 * n);
+    char **assign_arr = arena_alloc(&line_arena, sizeof *assign_arr * n);
+    struct stage *stages = arena_alloc(&line_arena, sizeof *stages * (n / 2 + 1));
+    int assign_len = 0;
+    struct timeout timeout = {0};
+    stages[0] = (struct stage) {.exec_arr = exec_arr, .redir = redirs, .assign = assign_arr};
+
+    for (size_t i = 0; i < opts->n_words; i++) {
+        /* init new loop vars */
+        int next = i + 1 < opts->n_words ? 1 : 0;
+        int n_ops = 0;
+        size_t op_len;
+        int command_pos = stages[n_stages].exec_arr == exec_arr + exec_len;
+        char *word = words[i];
+
+        // time prefix - report the resources used by the whole pipeline
+        if (command_pos && n_stages == 0 && !timed && next && strcmp("time", word) == 0) {
+            timed = 1;
+        }
+
+        // timeout prefix - signal the pipeline once DURATION has passed
+        else if (command_pos && n_stages == 0 && timeout.ns == 0 && next && strcmp("timeout", word) == 0) {
+            if (timeout_parse(opts, &i, &timeout) != 0) {
+                opts->exit_status = 125;
+                return 1;
+            }
+        }
+
+        // built-ins that change the PARENT process (cd, exit, jobs, ...) - parsed like any command, so their
+        // redirections are known, and run at the end of the line
+        else if (command_pos && parent == NULL && (parent = parent_builtin_find(word)) != NULL) {
+            exec_arr[exec_len++] = word;
+
+        // NAME=value before the command - goes to the stage's environment
+        } else if (command_pos && var_name_len(word) > 0) {
+            assign_arr[assign_len++] = word;
+
+        // here-string attached to its word - <<<WORD
+        } else if (strncmp("<<<", word, 3) == 0 && word[3] != '\0') {
+            redirs[redir_len++] = (struct redir) {.type = REDIR_HERESTRING, .path = word + 3};
+
+        // a here-document read_heredocs did not collect (inside $(...)) has no lines to read
+        } else if (strncmp("<<", word, 2) == 0 && strcmp("<<<", word) != 0 && word != heredoc_word &&
+                   word != heredoc_raw_word) {
+            fprintf(stderr, "Here-document needs its own input lines.\n");
+            opts->exit_status = 1;
+            return 1;
+
+        // detect file redirection commands and add them to the stage's redirections - the target is the rest of
+        // the word (2>err, 2>&1) or the next word
+        } else if ((op_len = redir_parse(word, &redirs[redir_len], &n_ops)) > 0 || strcmp("<<", word) == 0 ||
+                   strcmp("<<<", word) == 0) {
+            if (op_len == 0 || word[op_len] == '\0') {
+                if (!next) {
+                    fprintf(stderr, "Invalid file redirect - no file argument.\n");
+                    opts->exit_status = 2;
+                    return 1;
+                }
+                i++;
+            }
+            char const *target = op_len > 0 && word[op_len] != '\0' ? word + op_len : words[i];
+            struct redir *r = &redirs[redir_len];
+            if (op_len == 0) {
+                *r = (struct redir) {.type = word[2] == '<' ? REDIR_HERESTRING : REDIR_HEREDOC, .path = target};
+                n_ops = 1;
+            } else if (r->type == REDIR_DUP) {
+                char *end;
+                long fd = strtol(target, &end, 10);
+                if (!isdigit((unsigned char) target[0]) || *end != '\0' || fd > INT_MAX) {
+                    fprintf(stderr, "Invalid file redirect - %s is not a file descriptor.\n", target);
+                    opts->exit_status = 1;
+                    return 1;
+                }
+                r->dup_fd = (int) fd;
+            } else {
+                r->path = target;
+            }
+            redir_len += n_ops;
+
+        // end the current pipeline stage - its arguments stay NULL terminated in exec_arr
+        } else if (strcmp("|", word) == 0) {
+            if (command_pos || !next) {
+                fprintf(stderr, "Invalid pipe - missing command.\n");
+                opts->exit_status = 1;
+                return 1;
+            }
+            stages[n_stages].redir_len = redir_len - (int) (stages[n_stages].redir - redirs);
+            stages[n_stages].assign_len = assign_len - (int) (stages[n_stages].assign - assign_arr);
+            exec_arr[exec_len++] = NULL;
+            n_stages++;
+            stages[n_stages] = (struct stage) {.exec_arr = exec_arr + exec_len, .redir = redirs + redir_len,
+                                               .assign = assign_arr + assign_len};
+
+        // detect if a background command
+        } else if (strcmp("&", word) == 0) {
+            background = 1;
+
+        // add executable commands to the execute array
+        } else {
+                exec_arr[exec_len] = word;
+                exec_len++;
+        }
+
+        // execute at the end of each line
+        if (i >= opts->n_words - 1) {
+            exec_arr[exec_len] = NULL;
+            stages[n_stages].redir_len = redir_len - (int) (stages[n_stages].redir - redirs);
+            stages[n_stages].assign_len = assign_len - (int) (stages[n_stages].assign - assign_arr);
+            if (parent != NULL) {
+                return run_parent_builtin(opts, parent, &stages[0], n_stages > 0 || background);
+            } else if (exec_len == 0 && redir_len == 0 && !background && !timed) {
+                // a line of nothing but assignments sets shell variables
+                for (int a = 0; a < assign_len; a++) var_set(&opts->vars, assign_arr[a], 0);
+                opts->exit_status = 0;
+            } else if (background && opts->jobs.max_running > 0 && opts->jobs.running >= opts->jobs.max_running) {
+                // every jobs-max slot is taken - the line starts when one frees up
+                job_queue_add(opts);
+            } else {
+                execute(opts, stages, n_stages + 1, background, timed, &timeout);
+            }
+            opts->index = i;
+        }
+    }
+    return 0;
+}
+
+/* built-ins run by the shell itself, sorted for bsearch */
+struct parent_builtin const parent_builtins[] = {
+    {"cd", change_dir},
+    {"exit", exit_pgm},
+    {"export", export_builtin},
+    {"hash", hash_builtin},
+    {"history", history_builtin},
+    {"jobs", jobs_builtin},
+    {"jobs-max", jobs_max_builtin},
+    {"set", set_option},
+    {"ulimit", ulimit_builtin},
+    {"unset", unset_builtin},
+    {"wait", wait_builtin},
+};
+
+static int parent_builtin_cmp(void const *name, void const *entry) {
+    return strcmp(name, ((struct parent_builtin const *) entry)->name);
+}
+
+/**
+ * Looks up a built-in that has to run in the shell process
+ * @return - table entry, or NULL if name is not one
+ */
+struct parent_builtin const *parent_builtin_find(char const *name) {
+    return bsearch(name, parent_builtins, sizeof parent_builtins / sizeof parent_builtins[0],
+                   sizeof parent_builtins[0], parent_builtin_cmp);
+}
+
+/**
+ * Runs a built-in that changes the PARENT process, with its redirections applied to the shell's own stdin, stdout and
+ * stderr around it. In a pipeline or in the background it would change a child instead, so such lines are rejected.
+ * @return - 0, or 1 if the line was rejected or a redirection failed ($? is set)
+ */
+int run_parent_builtin(struct sh_options *opts, struct parent_builtin const *b, struct stage *stage, int detached) {
+    if (detached) {
+        fprintf(stderr, "%s: cannot be part of a pipeline or run in the background\n", b->name);
+        opts->exit_status = 2;
+        return 1;
+    }
+    // none of them reads stdin, so here-documents and here-strings are dropped
+    int n_redir = 0;
+    for (int r = 0; r < stage->redir_len; r++) {
+        struct redir const *op = &stage->redir[r];
+        if (op->type == REDIR_HEREDOC || op->type == REDIR_HERESTRING) continue;
+        if (op->fd > STDERR_FILENO || (op->type == REDIR_DUP && op->dup_fd > STDERR_FILENO)) {
+            fprintf(stderr, "%s: only stdin, stdout and stderr can be redirected\n", b->name);
+            opts->exit_status = 2;
+            return 1;
+        }
+        stage->redir[n_redir++] = *op;
+    }
+    stage->redir_len = n_redir;
+
+    // the command's words become the line the built-in reads its arguments from
+    size_t argc = 0;
+    for (; stage->exec_arr[argc] != NULL; argc++) words[argc] = stage->exec_arr[argc];
+    opts->n_words = argc;
+
+    int saved[3] = {-1, -1, -1};
+    fflush(stdout);
+    if (redir_save(stage, saved) != 0) {
+        redir_restore(saved);
+        opts->exit_status = 1;
+        return 1;
+    }
+    b->run(0, opts);
+    fflush(stdout);
+    redir_restore(saved);
+    return 0;
+}
+
+/**
+ * Exit the parent process - the main shell sets $? and leaves through the cleanup at the end of main, so every live
+ * job is signalled as at EOF; $(...) children and --serve workers exit at once
+ */
+int exit_pgm(size_t i, struct sh_options *opts){
+    int exit_num;
+    /* if no cmd line arg after exit use exit status of last foreground cmd */
+    if (i + 1 == opts->n_words) {
+        exit_num = opts->exit_status;
+        /* if more than one cmd line arg, exit with error */
+    } else if (opts->n_words > i + 2) {
+        //fprintf(stderr, "Error: More than one command line argument provided with exit.");
+        exit_num = 1;
+    } else {
+        exit_num = (int) strtol(words[i + 1], NULL, 0);
+        //if (exit_num == 0) fprintf(stderr, "Exit argument was not a number");
+    }
+    if (opts->serving || getpid() != opts->parent_pid) exit(exit_num);
+    opts->exit_status = exit_num;
+    opts->exiting = 1;
+    return 0;
+}
+
+/**
+ * Change directories in the parent process
+ */
+int change_dir(size_t i, struct sh_options *opts) {
+    int success = 0;
+    /* if no arguments */
+    if (i == opts->n_words - 1) {
+        char const *home = var_get(&opts->vars, "HOME");
+        success = home ? chdir(home) : -1;
+        /* if one argument */
+    } else if (i + 1 == opts->n_words - 1) {
+        success = chdir(words[i + 1]);
+        /* if more than one argument */
+    } else {
+        //fprintf(stderr, "Too many change directory arguments provided");
+        if (!opts->serving) exit(1);
+        warnx("cd: too many arguments");
+        opts->exit_status = 1;
+        return 1;
+    }
+    if (success != 0) {
+        //fprintf(stderr, "Error changing directory");
+        if (!opts->serving) exit(1);
+        warn("cd: %s", i + 1 < opts->n_words ? words[i + 1] : "HOME");
+        opts->exit_status = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Shell options - only "set -o pipefail" / "set +o pipefail" are supported
+ */
+int set_option(size_t i, struct sh_options *opts) {
+    if (i + 2 == opts->n_words - 1 && strcmp("pipefail", words[i + 2]) == 0) {
+        if (strcmp("-o", words[i + 1]) == 0) {
+            opts->pipefail = 1;
+            return 0;
+        } else if (strcmp("+o", words[i + 1]) == 0) {
+            opts->pipefail = 0;
+            return 0;
+        }
+    }
+    fprintf(stderr, "set: usage: set [-o|+o] pipefail\n");
+    opts->exit_status = 2;
+    return 1;
+}
+
+/* ulimit resources - option letter, resource and the unit its values are counted in */
+static struct {
+    char letter;
+    int resource;
+    rlim_t unit;
+    char const *name;
+} const ulimit_table[] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (kB)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (kB)"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (kB)"},
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kB)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kB)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kB)"},
+};
+
+/**
+ * Prints a limit as ulimit shows it - in its unit, or "unlimited"
+ */
+static void ulimit_print(rlim_t value, rlim_t unit) {
+    if (value == RLIM_INFINITY) printf("unlimited\n");
+    else printf("%ju\n", (uintmax_t) (value / unit));
+}
+
+/**
+ * Resource limits of the commands started after it - ulimit [-H|-S] [-a | -cdflnstuv [VALUE]]. Limits are kept in
+ * opts and set in each child before exec, the shell itself keeps its own; -H and -S pick the hard or soft limit
+ * (setting both without either), -f is the default resource.
+ */
+int ulimit_builtin(size_t i, struct sh_options *opts) {
+    size_t n_entries = sizeof ulimit_table / sizeof *ulimit_table, entry = 2;   // -f
+    int hard = 0, soft = 0, all = 0;
+    char const *value = NULL;
+    for (size_t w = i + 1; w < opts->n_words; w++) {
+        char const *word = words[w];
+        if (word[0] != '-' || word[1] == '\0' || value != NULL) {
+            if (value != NULL) goto usage;
+            value = word;
+            continue;
+        }
+        for (char const *c = word + 1; *c; c++) {
+            if (*c == 'H') hard = 1;
+            else if (*c == 'S') soft = 1;
+            else if (*c == 'a') all = 1;
+            else {
+                entry = 0;
+                while (entry < n_entries && ulimit_table[entry].letter != *c) entry++;
+                if (entry == n_entries) goto usage;
+            }
+        }
+    }
+    if (all && value != NULL) goto usage;
+
+    // print - the limit a command would get
+    if (value == NULL) {
+        for (size_t e = all ? 0 : entry; e < (all ? n_entries : entry + 1); e++) {
+            int r = ulimit_table[e].resource;
+            struct rlimit lim = opts->limits[r];
+            if (!(opts->limits_set & 1u << r)) getrlimit(r, &lim);
+            if (all) printf("%-26s (-%c) ", ulimit_table[e].name, ulimit_table[e].letter);
+            ulimit_print(hard ? lim.rlim_max : lim.rlim_cur, ulimit_table[e].unit);
+        }
+        fflush(stdout);
+        opts->exit_status = 0;
+        return 0;
+    }
+
+    // set
+    int r = ulimit_table[entry].resource;
+    rlim_t unit = ulimit_table[entry].unit, limit = RLIM_INFINITY;
+    if (strcmp("unlimited", value) != 0) {
+        char *end;
+        errno = 0;
+        uintmax_t n = strtoumax(value, &end, 10);
+        if (!isdigit((unsigned char) value[0]) || *end != '\0' || errno != 0 || n > (RLIM_INFINITY - 1) / unit) {
+            fprintf(stderr, "ulimit: %s: invalid limit\n", value);
+            opts->exit_status = 1;
+            return 1;
+        }
+        limit = (rlim_t) n * unit;
+    }
+    struct rlimit lim, shell;
+    getrlimit(r, &shell);
+    lim = opts->limits_set & 1u << r ? opts->limits[r] : shell;
+    if (!hard && !soft) hard = soft = 1;
+    if (hard) lim.rlim_max = limit;
+    if (soft) lim.rlim_cur = limit;
+    if (lim.rlim_cur > lim.rlim_max) {
+        fprintf(stderr, "ulimit: soft limit exceeds the hard limit\n");
+        opts->exit_status = 1;
+        return 1;
+    }
+    // only root may raise a hard limit, and the children inherit the shell's
+    if (lim.rlim_max > shell.rlim_max && geteuid() != 0) {
+        fprintf(stderr, "ulimit: cannot raise the hard limit\n");
+        opts->exit_status = 1;
+        return 1;
+    }
+    opts->limits[r] = lim;
+    opts->limits_set |= 1u << r;
+    opts->exit_status = 0;
+    return 0;
+
+usage:
+    fprintf(stderr, "ulimit: usage: ulimit [-H|-S] [-a | -cdflnstuv [VALUE]]\n");
+    opts->exit_status = 2;
+    return 1;
+}
+
+/**
+ * FNV-1a hash of a command name
+ */
+static size_t path_hash(char const *name) {
+    size_t h = 2166136261u;
+    for (; *name; name++) h = (h ^ (unsigned char) *name) * 16777619u;
+    return h;
+}
+
+/**
+ * Returns the cache slot holding name, or the empty slot where it would go
+ */
+static struct path_entry *path_slot(struct path_cache *c, char const *name) {
+    size_t h = path_hash(name) & (c->n_slots - 1);
+    while (c->entries[h].name != NULL && strcmp(c->entries[h].name, name) != 0) {
+        h = (h + 1) & (c->n_slots - 1);
+    }
+    return &c->entries[h];
+}
+
+/**
+ * Forgets every cached path (hash -r, or PATH changed)
+ */
+void path_cache_clear(struct path_cache *c) {
+    for (size_t i = 0; i < c->n_slots; i++) {
+        free(c->entries[i].name);
+        free(c->entries[i].path);
+        c->entries[i] = (struct path_entry) {0};
+    }
+    c->len = 0;
+}
+
+/**
+ * Searches every $PATH directory for an executable called name
+ * @return - newly allocated absolute path, or NULL if there is none
+ */
+static char *path_search(char const *name, char const *path_env) {
+    size_t name_len = strlen(name);
+    for (char const *dir = path_env; dir; ) {
+        char const *colon = strchr(dir, ':');
+        size_t dir_len = colon ? (size_t) (colon - dir) : strlen(dir);
+        // an empty PATH entry means the current directory
+        char *full = malloc(dir_len + name_len + 3);
+        if (!full) err(1, "malloc");
+        if (dir_len == 0) strcpy(full, ".");
+        else memcpy(full, dir, dir_len), full[dir_len] = '\0';
+        strcat(full, "/");
+        strcat(full, name);
+        struct stat st;
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0) return full;
+        free(full);
+        dir = colon ? colon + 1 : NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Resolves a command name to the executable execvp would run, through the path cache. The cache is dropped whenever
+ * PATH is not the value it was filled under.
+ * @param count - count the lookup as a hit (hash NAME only fills the cache)
+ * @return - the cached absolute path, or NULL for names containing a slash and commands not found
+ */
+char const *path_lookup(struct path_cache *c, char const *name, char const *path_env, int count) {
+    if (strchr(name, '/') != NULL || name[0] == '\0') return NULL;
+    if (path_env == NULL) path_env = "/bin:/usr/bin";
+    if (c->path_env == NULL || strcmp(c->path_env, path_env) != 0) {
+        path_cache_clear(c);
+        free(c->path_env);
+        c->path_env = strdup(path_env);
+        if (!c->path_env) err(1, "strdup");
+    }
+
+    // grow and rehash at 50% load
+    if (2 * (c->len + 1) > c->n_slots) {
+        struct path_cache old = *c;
+        c->n_slots = old.n_slots ? old.n_slots * 2 : 64;
+        c->entries = calloc(c->n_slots, sizeof *c->entries);
+        if (!c->entries) err(1, "calloc");
+        for (size_t i = 0; i < old.n_slots; i++) {
+            if (old.entries[i].name) *path_slot(c, old.entries[i].name) = old.entries[i];
+        }
+        free(old.entries);
+    }
+
+    struct path_entry *entry = path_slot(c, name);
+    if (entry->name == NULL) {
+        char *path = path_search(name, path_env);
+        if (path == NULL) return NULL;
+        entry->name = strdup(name);
+        if (!entry->name) err(1, "strdup");
+        entry->path = path;
+        c->len++;
+    }
+    if (count) entry->hits++;
+    return entry->path;
+}
+
+/**
+ * The hash built-in in the parent process: "hash" lists hit counts and paths, "hash -r" empties the cache and
+ * "hash NAME..." looks the names up without running them
+ */
+int hash_builtin(size_t i, struct sh_options *opts) {
+    struct path_cache *c = &opts->paths;
+    opts->exit_status = 0;
+    if (i + 1 == opts->n_words) {
+        if (c->len == 0) {
+            fprintf(stderr, "hash: hash table empty\n");
+            return 0;
+        }
+        printf("hits\tcommand\n");
+        for (size_t s = 0; s < c->n_slots; s++) {
+            if (c->entries[s].name) printf("%4lu\t%s\n", c->entries[s].hits, c->entries[s].path);
+        }
+        fflush(stdout);
+        return 0;
+    }
+    for (size_t w = i + 1; w < opts->n_words; w++) {
+        if (strcmp("-r", words[w]) == 0) {
+            path_cache_clear(c);
+        } else if (path_lookup(c, words[w], var_get(&opts->vars, "PATH"), 0) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", words[w]);
+            opts->exit_status = 1;
+        }
+    }
+    return opts->exit_status;
+}
+
+/**
+ * FNV-1a hash of the len byte variable name
+ */
+static size_t var_hash(char const *name, size_t len) {
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char) name[i]) * 16777619u;
+    return h;
+}
+
+/**
+ * Returns the slot holding the variable, or the empty slot where it would go - n_slots is always a power of two
+ */
+static struct var *var_slot(struct var_table *t, char const *name, size_t len) {
+    size_t mask = t->n_slots - 1;
+    size_t h = var_hash(name, len) & mask;
+    while (t->vars[h].pair != NULL &&
+           (t->vars[h].name_len != len || memcmp(t->vars[h].pair, name, len) != 0)) {
+        h = (h + 1) & mask;
+    }
+    return &t->vars[h];
+}
+
+/**
+ * Length of the variable name at the start of s - a letter or _ followed by letters, digits and _
+ * @return - length of the name, 0 if s does not start with one
+ */
+static size_t var_ident(char const *s) {
+    if (!isalpha((unsigned char) s[0]) && s[0] != '_') return 0;
+    size_t len = 1;
+    while (isalnum((unsigned char) s[len]) || s[len] == '_') len++;
+    return len;
+}
+
+/**
+ * Length of NAME if word is a NAME=value assignment
+ * @return - length of the name, 0 if word is not an assignment
+ */
+size_t var_name_len(char const *word) {
+    size_t len = var_ident(word);
+    return len > 0 && word[len] == '=' ? len : 0;
+}
+
+/**
+ * Compares two NAME=value pairs by name for qsort
+ */
+static int var_cmp(void const *a, void const *b) {
+    char const *x = *(char *const *) a, *y = *(char *const *) b;
+    size_t x_len = strcspn(x, "="), y_len = strcspn(y, "=");
+    int c = memcmp(x, y, x_len < y_len ? x_len : y_len);
+    return c ? c : (x_len > y_len) - (x_len < y_len);
+}
+
+/**
+ * Looks up the variable named by the first len bytes of name
+ * @return - the variable, NULL if it is not set
+ */
+struct var *var_find(struct var_table *t, char const *name, size_t len) {
+    if (t->len == 0) return NULL;
+    struct var *v = var_slot(t, name, len);
+    return v->pair ? v : NULL;
+}
+
+/**
+ * Value of a variable
+ * @return - the value, NULL if it is not set
+ */
+char const *var_get(struct var_table *t, char const *name) {
+    struct var *v = var_find(t, name, strlen(name));
+    return v ? v->pair + v->name_len + 1 : NULL;
+}
+
+/**
+ * Keeps a replaced exported pair alive until envp no longer refers to it
+ */
+static void var_retire(struct var_table *t, char *pair) {
+    if (t->n_retired == t->retired_cap) {
+        t->retired_cap = t->retired_cap ? t->retired_cap * 2 : 16;
+        char **tmp = realloc(t->retired, sizeof *tmp * t->retired_cap);
+        if (!tmp) err(1, "realloc");
+        t->retired = tmp;
+    }
+    t->retired[t->n_retired++] = pair;
+}
+
+/**
+ * Sets a variable from a NAME=value assignment - export 1 exports it, 0 keeps the variable's current flag. Changing an
+ * exported variable marks envp for rebuilding; the pair it replaced stays allocated until then, since environ still
+ * points at it.
+ */
+void var_set(struct var_table *t, char const *assignment, int export) {
+    size_t len = var_name_len(assignment);
+    if (2 * (t->len + 1) > t->n_slots) {
+        // grow and rehash at 50% load
+        struct var_table old = *t;
+        t->n_slots = old.n_slots ? old.n_slots * 2 : 128;
+        t->vars = calloc(t->n_slots, sizeof *t->vars);
+        if (!t->vars) err(1, "calloc");
+        for (size_t i = 0; i < old.n_slots; i++) {
+            if (old.vars[i].pair) *var_slot(t, old.vars[i].pair, old.vars[i].name_len) = old.vars[i];
+        }
+        free(old.vars);
+    }
+
+    char *pair = strdup(assignment);
+    if (!pair) err(1, "strdup");
+    struct var *v = var_slot(t, assignment, len);
+    if (v->pair == NULL) {
+        *v = (struct var) {.name_len = len};
+        t->len++;
+    } else if (v->exported) {
+        var_retire(t, v->pair);
+    } else {
+        free(v->pair);
+    }
+    v->pair = pair;
+    v->exported |= export;
+    if (v->exported) t->env_dirty = 1;
+}
+
+/**
+ * Removes a variable
+ * @return - 1 if it was set, 0 otherwise
+ */
+int var_unset(struct var_table *t, char const *name) {
+    struct var *v = var_find(t, name, strlen(name));
+    if (v == NULL) return 0;
+    if (v->exported) {
+        var_retire(t, v->pair);
+        t->env_dirty = 1;
+    } else {
+        free(v->pair);
+    }
+
+    // backward shift deletion keeps every probe chain intact without tombstones
+    size_t mask = t->n_slots - 1;
+    size_t hole = v - t->vars;
+    for (size_t h = (hole + 1) & mask; t->vars[h].pair != NULL; h = (h + 1) & mask) {
+        size_t home = var_hash(t->vars[h].pair, t->vars[h].name_len) & mask;
+        if (((h - home) & mask) >= ((h - hole) & mask)) {
+            t->vars[hole] = t->vars[h];
+            hole = h;
+        }
+    }
+    t->vars[hole] = (struct var) {0};
+    t->len--;
+    return 1;
+}
+
+/**
+ * Environment of child processes - envp is rebuilt from the exported variables (and installed as environ) only when
+ * one of them changed since the last call
+ */
+char **var_environ(struct var_table *t) {
+    if (!t->env_dirty && t->envp != NULL) return t->envp;
+    size_t n = 0;
+    for (size_t i = 0; i < t->n_slots; i++) n += t->vars[i].pair && t->vars[i].exported;
+    char **envp = malloc(sizeof *envp * (n + 1));
+    if (!envp) err(1, "malloc");
+    n = 0;
+    for (size_t i = 0; i < t->n_slots; i++) {
+        if (t->vars[i].pair && t->vars[i].exported) envp[n++] = t->vars[i].pair;
+    }
+    envp[n] = NULL;
+    environ = envp;
+    free(t->envp);
+    t->envp = envp;
+    for (size_t r = 0; r < t->n_retired; r++) free(t->retired[r]);
+    t->n_retired = 0;
+    t->env_dirty = 0;
+    return envp;
+}
+
+/**
+ * Seeds the table with the exported variables of the environment the shell started with
+ */
+void var_init(struct var_table *t) {
+    for (char **e = environ; *e; e++) {
+        if (var_name_len(*e) > 0) var_set(t, *e, 1);
+    }
+    var_environ(t);
+}
+
+/**
+ * Frees the variable table - environ goes back to an empty environment
+ */
+void var_table_free(struct var_table *t) {
+    static char *empty[] = {NULL};
+    environ = empty;
+    for (size_t i = 0; i < t->n_slots; i++) free(t->vars[i].pair);
+    for (size_t r = 0; r < t->n_retired; r++) free(t->retired[r]);
+    free(t->vars);
+    free(t->retired);
+    free(t->envp);
+    *t = (struct var_table) {0};
+}
+
+/**
+ * Environment of one stage - the shell's own envp, or with NAME=value prefixes a copy in line_arena where they take
+ * the place of (or are added to) the exported variables
+ */
+char **stage_env(struct sh_options *opts, struct stage *stage) {
+    char **envp = var_environ(&opts->vars);
+    if (stage->assign_len == 0) return envp;
+    size_t n = 0;
+    while (envp[n]) n++;
+    char **env = arena_alloc(&line_arena, sizeof *env * (n + stage->assign_len + 1));
+    size_t len = 0;
+    for (size_t e = 0; e < n; e++) {
+        int replaced = 0;
+        size_t name_len = var_name_len(envp[e]);
+        for (int a = 0; a < stage->assign_len && !replaced; a++) {
+            replaced = strncmp(envp[e], stage->assign[a], name_len + 1) == 0;
+        }
+        if (!replaced) env[len++] = envp[e];
+    }
+    for (int a = 0; a < stage->assign_len; a++) env[len++] = stage->assign[a];
+    env[len] = NULL;
+    return env;
+}
+
+/**
+ * The export built-in in the parent process: "export NAME=value..." sets and exports, "export NAME..." exports
+ * variables already set, and a bare "export" lists the exported variables sorted by name
+ */
+int export_builtin(size_t i, struct sh_options *opts) {
+    struct var_table *t = &opts->vars;
+    opts->exit_status = 0;
+    if (i + 1 == opts->n_words) {
+        char **envp = var_environ(t);
+        size_t n = 0;
+        while (envp[n]) n++;
+        char **sorted = arena_alloc(&line_arena, sizeof *sorted * (n + 1));
+        memcpy(sorted, envp, sizeof *sorted * n);
+        qsort(sorted, n, sizeof *sorted, var_cmp);
+        for (size_t e = 0; e < n; e++) printf("export %s\n", sorted[e]);
+        fflush(stdout);
+        return 0;
+    }
+    for (size_t w = i + 1; w < opts->n_words; w++) {
+        char *word = words[w];
+        size_t len = var_ident(word);
+        if (len > 0 && word[len] == '=') {
+            var_set(t, word, 1);
+        } else if (len > 0 && word[len] == '\0') {
+            // a NAME that is not set stays unset
+            struct var *v = var_find(t, word, len);
+            if (v != NULL && !v->exported) {
+                v->exported = 1;
+                t->env_dirty = 1;
+            }
+        } else {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", word);
+            opts->exit_status = 1;
+        }
+    }
+    return opts->exit_status;
+}
+
+/**
+ * The unset built-in in the parent process: "unset NAME..." removes the variables (exported ones leave the
+ * environment of later commands)
+ */
+int unset_builtin(size_t i, struct sh_options *opts) {
+    opts->exit_status = 0;
+    for (size_t w = i + 1; w < opts->n_words; w++) {
+        size_t len = var_ident(words[w]);
+        if (len == 0 || words[w][len] != '\0') {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", words[w]);
+            opts->exit_status = 1;
+            continue;
+        }
+        var_unset(&opts->vars, words[w]);
+    }
+    return opts->exit_status;
+}
+
+/**
+ * Reads a timeout duration - seconds, with an optional s, m, h or d suffix
+ * @return - 0 on success, -1 if it is not one
+ */
+static int timeout_duration(char const *word, uint64_t *ns) {
+    char *end;
+    errno = 0;
+    double seconds = strtod(word, &end);
+    if (end == word || errno != 0 || !(seconds >= 0)) return -1;
+    switch (*end) {
+        case 'd': seconds *= 24;    // fall through
+        case 'h': seconds *= 60;    // fall through
+        case 'm': seconds *= 60;    // fall through
+        case 's': end++;            // fall through
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end != '\0' || seconds > 1e9) return -1;
+    *ns = (uint64_t) (seconds * 1e9);
+    return 0;
+}
+
+/**
+ * Reads the timeout prefix at words[*i] - timeout [-k DURATION] DURATION COMMAND - and leaves *i on its last word
+ * @return - 0 on success, -1 after printing the usage
+ */
+int timeout_parse(struct sh_options *opts, size_t *i, struct timeout *timeout) {
+    size_t w = *i + 1;
+    timeout->kill_ns = TIMEOUT_KILL_NS;
+    if (w + 1 < opts->n_words && strcmp("-k", words[w]) == 0) {
+        if (timeout_duration(words[w + 1], &timeout->kill_ns) != 0) goto usage;
+        w += 2;
+    }
+    // a duration of 0 runs the command without one, as timeout(1) does
+    if (w + 1 >= opts->n_words || timeout_duration(words[w], &timeout->ns) != 0) goto usage;
+    *i = w;
+    return 0;
+
+usage:
+    fprintf(stderr, "timeout: usage: timeout [-k DURATION] DURATION COMMAND\n");
+    return -1;
+}
+
+/**
+ * Arms a timerfd to expire once, ns from now
+ */
+static void timer_arm(int fd, uint64_t ns) {
+    struct itimerspec its = {.it_value = {.tv_sec = ns / 1000000000u, .tv_nsec = ns % 1000000000u}};
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    timerfd_settime(fd, 0, &its, NULL);
+}
+
+/**
+ * Sends the next signal of an expired timeout to a pipeline - its process group under job control, else each of the
+ * n pids. SIGTERM (with SIGCONT, so a stopped pipeline sees it) comes first and re-arms the timer for SIGKILL.
+ * @return - signals sent so far
+ */
+static int timeout_fire(struct sh_options *opts, int timer_fd, uint64_t kill_ns, int fired, pid_t pgid,
+                        pid_t const pids[], int n) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof expirations) != sizeof expirations || fired >= 2) return fired;
+    int sig = fired == 0 ? SIGTERM : SIGKILL;
+    for (int p = 0; p < (opts->job_control ? 1 : n); p++) {
+        pid_t target = opts->job_control ? -pgid : pids[p];
+        kill(target, sig);
+        if (sig == SIGTERM) kill(target, SIGCONT);
+    }
+    if (sig == SIGTERM && kill_ns > 0) timer_arm(timer_fd, kill_ns);
+    return fired + 1;
+}
+
+/**
+ * Waits for a foreground stage to stop or finish while timeouts are running - the pipeline's own (timer_fd, -1 for
+ * none) and those of background jobs, which would otherwise fire only once the shell is back at its event loop. The
+ * wait4 that follows does not block. A stop only shows as SIGCHLD, so the signalfd is watched too; one meant for
+ * another child is left for wait_events in opts->sigchld.
+ */
+static void timeout_wait(struct sh_options *opts, int timer_fd, struct timeout const *timeout, int *fired,
+                         pid_t pgid, pid_t const pids[], int n, int s) {
+    struct pollfd fds[opts->jobs.len + 3];
+    pid_t timed[opts->jobs.len + 3];
+    int n_fds = 3;
+    for (size_t j = 0; j < opts->jobs.len; j++) {
+        if (opts->jobs.jobs[j].timer_fd == -1) continue;
+        timed[n_fds] = opts->jobs.jobs[j].pid;
+        fds[n_fds++] = (struct pollfd) {.fd = opts->jobs.jobs[j].timer_fd, .events = POLLIN};
+    }
+    if (timer_fd == -1 && n_fds == 3) return;
+    fds[0] = (struct pollfd) {.fd = pidfd_open(pids[s], 0), .events = POLLIN};
+    fds[1] = (struct pollfd) {.fd = timer_fd, .events = POLLIN};
+    fds[2] = (struct pollfd) {.fd = opts->signal_fd, .events = POLLIN};
+    if (fds[0].fd == -1) return;
+
+    while (poll(fds, n_fds, -1) != -1 || errno == EINTR) {
+        if (fds[0].revents) break;
+        if (fds[2].revents) {
+            siginfo_t info = {0};
+            if (waitid(P_PID, pids[s], &info, WEXITED | WSTOPPED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pids[s]) {
+                break;
+            }
+            struct signalfd_siginfo si;
+            while (read(opts->signal_fd, &si, sizeof si) == sizeof si) {
+                if (si.ssi_signo == SIGCHLD) opts->sigchld = 1;
+            }
+        }
+        if (fds[1].revents) *fired = timeout_fire(opts, timer_fd, timeout->kill_ns, *fired, pgid, pids, n);
+        for (int f = 3; f < n_fds; f++) {
+            if (fds[f].revents) job_timeout(opts, timed[f]);
+        }
+    }
+    close(fds[0].fd);
+}
+
+/**
+ * Timeout of a background pipeline expired - signals every process of the job pid belongs to
+ */
+void job_timeout(struct sh_options *opts, pid_t pid) {
+    struct job *job = job_find(&opts->jobs, pid);
+    if (job == NULL || job->timer_fd == -1) return;
+    pid_t pids[opts->jobs.len];
+    int n = 0;
+    for (size_t j = 0; j < opts->jobs.len; j++) {
+        if (opts->jobs.jobs[j].id == job->id) pids[n++] = opts->jobs.jobs[j].pid;
+    }
+    job->timed_out = timeout_fire(opts, job->timer_fd, job->kill_ns, job->timed_out, job->pgid, pids, n);
+}
+
+/**
+ * Hands a pipeline's timeout and --cgroup leaf to its last background job - the timer is watched by the event loop,
+ * or dropped where there is none (batch workers and command substitutions)
+ */
+static void job_limits(struct sh_options *opts, struct job *job, int timer_fd, struct timeout const *timeout,
+                       int fired, char *cgroup) {
+    job->cgroup = cgroup;
+    job->timed_out = fired;
+    job->kill_ns = timeout->kill_ns;
+    if (timer_fd == -1) return;
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = WATCH_KEY(WATCH_TIMER, job->pid)};
+    if (opts->jobs.watch_fd != -1 && epoll_ctl(opts->jobs.watch_fd, EPOLL_CTL_ADD, timer_fd, &ev) == 0) {
+        job->timer_fd = timer_fd;
+    } else {
+        close(timer_fd);
+    }
+}
+
+/**
+ * Writes value into file of the --cgroup leaf
+ * @return - 0 on success, -1 with errno set
+ */
+static int cgroup_write(struct sh_options *opts, char const *leaf, char const *file, char const *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s", leaf, file);
+    int fd = openat(opts->cgroup_fd, path, O_WRONLY | O_CLOEXEC);
+    ssize_t len = (ssize_t) strlen(value);
+    int ok = fd != -1 && write(fd, value, len) == len;
+    if (fd != -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return ok ? 0 : -1;
+}
+
+/**
+ * Opens --cgroup DIR, which has to be a writable cgroup v2 directory, and enables the controllers of the
+ * --cgroup-memory and --cgroup-cpu limits for its children - a limit whose controller is missing is dropped
+ */
+void cgroup_init(struct sh_options *opts, char const *dir) {
+    struct statfs fs;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || fstatfs(fd, &fs) == -1 || fs.f_type != CGROUP2_SUPER_MAGIC || access(dir, W_OK) == -1) {
+        warnx("%s: not a writable cgroup v2 directory, jobs run without cgroups", dir);
+        if (fd != -1) close(fd);
+        return;
+    }
+    opts->cgroup_fd = fd;
+    if (opts->cgroup_memory != NULL && cgroup_write(opts, ".", "cgroup.subtree_control", "+memory") == -1) {
+        warn("%s: no memory controller, jobs run without a memory limit", dir);
+        free(opts->cgroup_memory);
+        opts->cgroup_memory = NULL;
+    }
+    if (opts->cgroup_cpu != NULL && cgroup_write(opts, ".", "cgroup.subtree_control", "+cpu") == -1) {
+        warn("%s: no cpu controller, jobs run without a cpu limit", dir);
+        free(opts->cgroup_cpu);
+        opts->cgroup_cpu = NULL;
+    }
+}
+
+/**
+ * Removes the leaves that still held processes when their job was reported - any that are empty by now
+ */
+void cgroup_sweep(struct sh_options *opts) {
+    size_t kept = 0;
+    for (size_t s = 0; s < opts->n_cgroup_stale; s++) {
+        if (unlinkat(opts->cgroup_fd, opts->cgroup_stale[s], AT_REMOVEDIR) == 0 || errno == ENOENT) {
+            free(opts->cgroup_stale[s]);
+        } else {
+            opts->cgroup_stale[kept++] = opts->cgroup_stale[s];
+        }
+    }
+    opts->n_cgroup_stale = kept;
+}
+
+/**
+ * Makes the --cgroup leaf of a new job, named after the shell's pid and a sequence number, with the memory.max and
+ * cpu.max of --cgroup-memory and --cgroup-cpu
+ * @return - leaf name (caller frees it), NULL if it could not be made
+ */
+char *cgroup_create(struct sh_options *opts) {
+    static unsigned long seq;
+    char *name;
+    cgroup_sweep(opts);
+    if (asprintf(&name, "smallsh-%jd-%lu", (intmax_t) getpid(), seq++) == -1) err(1, "asprintf");
+    if (mkdirat(opts->cgroup_fd, name, 0755) == -1) {
+        warn("cgroup %s", name);
+        free(name);
+        return NULL;
+    }
+    if (opts->cgroup_memory != NULL && cgroup_write(opts, name, "memory.max", opts->cgroup_memory) == -1) {
+        warn("%s/memory.max", name);
+    }
+    if (opts->cgroup_cpu != NULL && cgroup_write(opts, name, "cpu.max", opts->cgroup_cpu) == -1) {
+        warn("%s/cpu.max", name);
+    }
+    return name;
+}
+
+/**
+ * Reports the peak memory of a finished job - memory.peak of its leaf, or the largest maxrss of its processes
+ * without a memory controller - and removes the leaf, or keeps it for cgroup_sweep while processes remain
+ */
+void cgroup_finish(struct sh_options *opts, char *name, pid_t pid, long maxrss) {
+    uintmax_t peak_kb = (uintmax_t) maxrss;
+    char path[PATH_MAX], buf[32];
+    snprintf(path, sizeof path, "%s/memory.peak", name);
+    int fd = openat(opts->cgroup_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        ssize_t n = read(fd, buf, sizeof buf - 1);
+        if (n > 0) {
+            buf[n] = '\0';
+            peak_kb = strtoumax(buf, NULL, 10) / 1024;
+        }
+        close(fd);
+    }
+    fprintf(stderr, "Child process %jd peak memory %ju kB.\n", (intmax_t) pid, peak_kb);
+
+    if (unlinkat(opts->cgroup_fd, name, AT_REMOVEDIR) == -1) {
+        void *tmp = realloc(opts->cgroup_stale, sizeof *opts->cgroup_stale * (opts->n_cgroup_stale + 1));
+        if (!tmp) err(1, "realloc");
+        opts->cgroup_stale = tmp;
+        opts->cgroup_stale[opts->n_cgroup_stale] = strdup(name);
+        if (!opts->cgroup_stale[opts->n_cgroup_stale++]) err(1, "strdup");
+    }
+}
+
+/**
+ * Execute the command line statement in child processes redirecting or running in the background if requested.
+ * Each stage reads the previous stage's pipe; with job control the whole pipeline shares one process group.
+ * @param opts - global data struct for file commands
+ * @param stages - pipeline stages, each with its NULL terminated exec_arr and its redirections (applied in order)
+ * @param n_stages - number of stages
+ * @param background - if background command is present or not
+ * @param timed - if the line started with the time prefix
+ * @param timeout - timeout prefix of the line, signals the pipeline once it expires
+ */
+int execute(struct sh_options *opts, struct stage stages[], int n_stages, int background, int timed,
+            struct timeout const *timeout) {
+    pid_t pids[n_stages];
+    pid_t pgid = 0;
+    int in_fd = -1;
+    int fail_status = 0;
+    if (n_stages < 1) return 0;
+    uint64_t start_ns = monotonic_ns();
+    for (int s = 0; s < n_stages; s++) {
+        stages[s].here_fd = here_document(&stages[s]);
+        stages[s].env = stage_env(opts, &stages[s]);
+        stages[s].cgroup_fd = -1;
+    }
+
+    // a lone foreground echo, test, printf... runs in the shell itself - no fork, no exec (NAME=value prefixes are
+    // for the real program's environment)
+    struct builtin const *b = n_stages == 1 && !background && !timed && timeout->ns == 0 && stages[0].assign_len == 0
+                              ? builtin_find(&opts->vars, stages[0].exec_arr[0]) : NULL;
+    if (b != NULL) {
+        uint64_t phase_start = bench_now();
+        int status = run_builtin(b, &stages[0]);
+        bench_record(BENCH_SPAWN, phase_start);
+        if (status != BUILTIN_EXTERNAL) {
+            METRIC_ADD(commands, 1);
+            METRIC_ADD(builtins, 1);
+            if (stages[0].here_fd != -1) close(stages[0].here_fd);
+            opts->exit_status = status;
+            return 0;
+        }
+    }
+
+    // --cgroup - the pipeline gets a leaf of its own, which each stage joins before exec
+    char *cgroup = opts->cgroup_fd != -1 ? cgroup_create(opts) : NULL;
+    int procs_fd = -1;
+    if (cgroup != NULL) {
+        char procs[PATH_MAX];
+        snprintf(procs, sizeof procs, "%s/cgroup.procs", cgroup);
+        procs_fd = openat(opts->cgroup_fd, procs, O_WRONLY | O_CLOEXEC);
+        if (procs_fd == -1) {
+            warn("%s", procs);
+            unlinkat(opts->cgroup_fd, cgroup, AT_REMOVEDIR);
+            free(cgroup);
+            cgroup = NULL;
+        }
+        for (int s = 0; s < n_stages; s++) stages[s].cgroup_fd = procs_fd;
+    }
+
+    // start every stage connected to the next one by a pipe
+    for (int s = 0; s < n_stages; s++) {
+        int pipe_fds[2] = {-1, -1};
+        if (s + 1 < n_stages && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            //fprintf(stderr, "Error creating pipe");
+            exit(1);
+        }
+        uint64_t phase_start = bench_now();
+        pids[s] = launch_stage(opts, &stages[s], in_fd, pipe_fds[1], pgid);
+        bench_record(BENCH_SPAWN, phase_start);
+        METRIC_ADD(commands, 1);
+        if (opts->job_control) {
+            // set here too so the group exists before tcsetpgrp or a later stage joins it
+            if (pgid == 0) pgid = pids[s];
+            setpgid(pids[s], pgid);
+        }
+        if (in_fd != -1) close(in_fd);
+        if (pipe_fds[1] != -1) close(pipe_fds[1]);
+        if (stages[s].here_fd != -1) close(stages[s].here_fd);
+        in_fd = pipe_fds[0];
+    }
+    if (procs_fd != -1) close(procs_fd);
+
+    // the timeout runs from here - 0 for none
+    int timer_fd = -1, fired = 0;
+    if (timeout->ns > 0) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd == -1) warn("timerfd_create");
+        else timer_arm(timer_fd, timeout->ns);
+    }
+
+    // FOREGROUND PROCESSES
+    if (background == 0) {
+        int terminal = opts->job_control && isatty(STDIN_FILENO);
+        if (terminal) tcsetpgrp(STDIN_FILENO, pgid);
+        uint64_t phase_start = bench_now();
+        struct rusage ru, total = {0};
+        int stopped = 0;
+
+        for (int s = 0; s < n_stages; s++) {
+            // perform blocking wait and set exit value after exit
+            timeout_wait(opts, timer_fd, timeout, &fired, pgid, pids, n_stages, s);
+            opts->process_pid = wait4(pids[s], &opts->child_status, WUNTRACED, &ru);
+
+            // stopped for touching the terminal before it was handed over - let it continue in the foreground
+            if (terminal && WIFSTOPPED(opts->child_status) &&
+                (WSTOPSIG(opts->child_status) == SIGTTIN || WSTOPSIG(opts->child_status) == SIGTTOU)) {
+                kill(-pgid, SIGCONT);
+                s--;
+                continue;
+            }
+
+            int status = -1;
+            if (WIFEXITED(opts->child_status)) {
+                status = WEXITSTATUS(opts->child_status);
+            }
+            // if signaled - set exit value to n + 128
+            if WIFSIGNALED(opts->child_status) {
+                status = WTERMSIG(opts->child_status) + 128;
+            }
+            // timed out - 124 like timeout(1), or 137 if it took SIGKILL
+            if (fired && !WIFSTOPPED(opts->child_status)) status = fired == 1 ? 124 : 128 + SIGKILL;
+            // if process has stopped - restart and run the rest of the pipeline in the background
+            if WIFSTOPPED(opts->child_status) {
+                kill(opts->job_control ? -pgid : pids[s], SIGCONT);
+                fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) pids[s]);
+                opts->background_pid = opts->process_pid;
+                int id = 0;
+                for (int b = s; b < n_stages; b++) {
+                    struct job *job = job_add(&opts->jobs, pids[b], id);
+                    job->pgid = pgid;
+                    job->command = stage_command(&stages[b]);
+                    job->start_ns = start_ns;
+                    job->timed = timed;
+                    job->last = b == n_stages - 1;
+                    id = job->id;
+                    if (job->last) job_limits(opts, job, timer_fd, timeout, fired, cgroup);
+                }
+                timer_fd = -1;
+                cgroup = NULL;
+                opts->jobs.running++;
+                METRIC_ADD(jobs_started, 1);
+                stopped = 1;
+                break;
+            }
+
+            // account for the stage and add it to the pipeline totals
+            if (opts->acct_fd != -1) {
+                char *command = stage_command(&stages[s]);
+                acct_record(opts, pids[s], status, monotonic_ns() - start_ns, &ru, command);
+                free(command);
+            }
+            timeradd(&total.ru_utime, &ru.ru_utime, &total.ru_utime);
+            timeradd(&total.ru_stime, &ru.ru_stime, &total.ru_stime);
+            if (ru.ru_maxrss > total.ru_maxrss) total.ru_maxrss = ru.ru_maxrss;
+            total.ru_nvcsw += ru.ru_nvcsw;
+            total.ru_nivcsw += ru.ru_nivcsw;
+
+            if (status > 0) fail_status = status;
+            // exit status of the pipeline is the last stage, or the last failing stage with pipefail
+            if (s == n_stages - 1 && status != -1) {
+                opts->exit_status = opts->pipefail ? fail_status : status;
+            }
+        }
+        bench_record(BENCH_WAIT, phase_start);
+        if (timer_fd != -1) close(timer_fd);
+        if (cgroup != NULL) {
+            cgroup_finish(opts, cgroup, pids[n_stages - 1], total.ru_maxrss);
+            free(cgroup);
+        }
+        if (terminal) tcsetpgrp(STDIN_FILENO, opts->shell_pgid);
+        if (timed && !stopped) time_report(monotonic_ns() - start_ns, &total);
+    }
+    // BACKGROUND PROCESSES
+    else {
+        opts->background_pid = pids[n_stages - 1];
+        int id = opts->jobs.launch_id;
+        for (int s = 0; s < n_stages; s++) {
+            struct job *job = job_add(&opts->jobs, pids[s], id);
+            job->pgid = pgid;
+            job->command = stage_command(&stages[s]);
+            job->start_ns = start_ns;
+            job->timed = timed;
+            job->last = s == n_stages - 1;
+            id = job->id;
+            if (job->last) job_limits(opts, job, timer_fd, timeout, 0, cgroup);
+        }
+        opts->jobs.running++;
+        METRIC_ADD(jobs_started, 1);
+    }
+    fflush(stdout);
+
+    return 0;
+}
+
+/**
+ * CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Joins a stage's arguments with spaces for job reports
+ * @return - newly allocated command text
+ */
+char *stage_command(struct stage *stage) {
+    size_t len = 1;
+    for (char **arg = stage->exec_arr; *arg; arg++) len += strlen(*arg) + 1;
+    char *command = malloc(len);
+    if (!command) err(1, "malloc");
+    command[0] = '\0';
+    for (char **arg = stage->exec_arr; *arg; arg++) {
+        if (arg != stage->exec_arr) strcat(command, " ");
+        strcat(command, *arg);
+    }
+    return command;
+}
+
+/**
+ * Appends one record for a completed child to the --acct log, as a single write so concurrent shells (and -j workers)
+ * sharing the file never interleave. Tab separated fields: pid, exit status (128 + n if signaled), wall, user and
+ * sys seconds, max RSS in kB, minor and major page faults, blocks in and out, voluntary and involuntary context
+ * switches, command.
+ */
+void acct_record(struct sh_options *opts, pid_t pid, int status, uint64_t wall_ns, struct rusage *ru,
+                 char const *command) {
+    if (opts->acct_fd == -1) return;
+    char record[4096];
+    int len = snprintf(record, sizeof record, "%jd\t%d\t%ju.%06ju\t%jd.%06jd\t%jd.%06jd\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%s\n",
+                       (intmax_t) pid, status, (uintmax_t) (wall_ns / 1000000000u),
+                       (uintmax_t) (wall_ns % 1000000000u / 1000), (intmax_t) ru->ru_utime.tv_sec,
+                       (intmax_t) ru->ru_utime.tv_usec, (intmax_t) ru->ru_stime.tv_sec,
+                       (intmax_t) ru->ru_stime.tv_usec, ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_inblock,
+                       ru->ru_oublock, ru->ru_nvcsw, ru->ru_nivcsw, command);
+    // long commands are cut short but keep their newline
+    if (len >= (int) sizeof record) {
+        len = sizeof record;
+        record[len - 1] = '\n';
+    }
+    if (write(opts->acct_fd, record, len) != len) {
+        //fprintf(stderr, "Error writing accounting record\n");
+    }
+}
+
+/**
+ * Prints the report of the time prefix to stderr
+ */
+void time_report(uint64_t wall_ns, struct rusage *ru) {
+    fprintf(stderr, "real\t%ju.%03jus\nuser\t%jd.%03jds\nsys\t%jd.%03jds\nmaxrss\t%ld kB\n"
+                    "ctxsw\t%ld voluntary, %ld involuntary\n",
+            (uintmax_t) (wall_ns / 1000000000u), (uintmax_t) (wall_ns % 1000000000u / 1000000),
+            (intmax_t) ru->ru_utime.tv_sec, (intmax_t) ru->ru_utime.tv_usec / 1000,
+            (intmax_t) ru->ru_stime.tv_sec, (intmax_t) ru->ru_stime.tv_usec / 1000, ru->ru_maxrss, ru->ru_nvcsw,
+            ru->ru_nivcsw);
+}
+
+/**
+ * Reads the redirection operator at the start of word - [n]<, [n]>, [n]>>, [n]<>, [n]<&, [n]>&, &> and &>> (n is 0
+ * for the < forms and 1 for the > forms without it). Here-documents and here-strings are left to the caller.
+ * @param r - filled with the operation, the target (path or dup_fd) still to be set; &> adds 2>&1 as r[1]
+ * @param n_ops - operations written to r
+ * @return - length of the operator (its target follows it or is the next word), 0 if word is not one
+ */
+size_t redir_parse(char const *word, struct redir r[2], int *n_ops) {
+    size_t i = 0;
+    long fd = -1;
+    while (isdigit((unsigned char) word[i])) i++;
+    if (i > 0) {
+        if (i > 4 || (word[i] != '<' && word[i] != '>')) return 0;
+        fd = strtol(word, NULL, 10);
+    }
+    *n_ops = 1;
+
+    // &> and &>> - stdout and stderr to one file
+    if (i == 0 && word[0] == '&' && word[1] == '>') {
+        int append = word[2] == '>';
+        r[0] = (struct redir) {.type = REDIR_OPEN, .fd = STDOUT_FILENO,
+                               .flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC)};
+        r[1] = (struct redir) {.type = REDIR_DUP, .fd = STDERR_FILENO, .dup_fd = STDOUT_FILENO};
+        *n_ops = 2;
+        return 2 + (size_t) append;
+    }
+
+    char const *op = word + i;
+    if (op[0] == '<' && op[1] != '<') {
+        r[0] = (struct redir) {.type = REDIR_OPEN, .fd = fd == -1 ? STDIN_FILENO : (int) fd, .flags = O_RDONLY};
+        if (op[1] == '>') r[0].flags = O_RDWR | O_CREAT;
+        if (op[1] == '&') r[0].type = REDIR_DUP;
+        return i + 1 + (op[1] == '>' || op[1] == '&');
+    }
+    if (op[0] == '>') {
+        r[0] = (struct redir) {.type = REDIR_OPEN, .fd = fd == -1 ? STDOUT_FILENO : (int) fd,
+                               .flags = O_WRONLY | O_CREAT | O_TRUNC};
+        if (op[1] == '>') r[0].flags = O_WRONLY | O_CREAT | O_APPEND;
+        if (op[1] == '&') r[0].type = REDIR_DUP;
+        return i + 1 + (op[1] == '>' || op[1] == '&');
+    }
+    return 0;
+}
+
+/**
+ * Applies a stage's redirections in the forked child, in order - files are opened close-on-exec and moved onto their
+ * descriptor with dup3, so the command gets the descriptors it asked for and nothing else
+ * @return - 0 on success, -1 at the first one that failed
+ */
+int redir_apply(struct stage const *stage) {
+    for (int r = 0; r < stage->redir_len; r++) {
+        struct redir const *op = &stage->redir[r];
+        int from = op->type == REDIR_OPEN ? open(op->path, op->flags | O_CLOEXEC, 0777)
+                 : op->type == REDIR_DUP ? op->dup_fd : stage->here_fd;
+        if (from == -1) return -1;
+        // already in place - the open got the descriptor itself, or n>&n
+        if (from == op->fd) {
+            if (fcntl(from, F_SETFD, 0) == -1) return -1;
+            continue;
+        }
+        int moved = dup3(from, op->fd, 0);
+        if (op->type == REDIR_OPEN) close(from);
+        if (moved == -1) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Starts one pipeline stage reading in_fd and writing out_fd (-1 keeps the shell's stdin/stdout), in process group
+ * pgid (0 starts a new one) when job control is on.
+ * @return - pid of the stage
+ */
+pid_t launch_stage(struct sh_options *opts, struct stage *stage, int in_fd, int out_fd, pid_t pgid) {
+    pid_t child_pid = -5;
+    char **exec_arr = stage->exec_arr;
+    int builtin = exec_arr[0] != NULL && strcmp("ztee", exec_arr[0]) == 0;
+    char const *path = exec_arr[0] != NULL && !builtin
+                       ? path_lookup(&opts->paths, exec_arr[0], var_get(&opts->vars, "PATH"), 1) : NULL;
+
+    // fast path - fork only for built-in stages, ulimit settings or a --cgroup leaf (posix_spawn can do neither), or
+    // when spawning is disabled or failed, the forked child then reports the error as before
+    int spawn = USE_SPAWN && !builtin && opts->limits_set == 0 && stage->cgroup_fd == -1;
+    child_pid = spawn ? spawn_command(opts, stage, path, in_fd, out_fd, pgid) : -1;
+    if (child_pid == -1) child_pid = fork();
+    if (child_pid != -1) opts->children++;
+
+    // if fork failed
+    switch (child_pid) {
+        case -1:
+            //fprintf(stderr, "Error creating fork");
+            exit(1);
+
+        // CHILD PROCESS - reset signals or original state, perform re-direction and execute command
+        // (_exit on failure - exit() would flush the shared script FILE and rewind the parent's input)
+        case 0:
+            if (opts->job_control) setpgid(0, pgid);
+
+            // ulimit settings and the job's cgroup - before exec, so the command never runs outside them
+            for (int r = 0; r < RLIM_NLIMITS; r++) {
+                if ((opts->limits_set & 1u << r) && setrlimit(r, &opts->limits[r]) == -1) _exit(1);
+            }
+            if (stage->cgroup_fd != -1 && write(stage->cgroup_fd, "0", 1) != 1) _exit(1);
+
+            // reset all signals
+            sigaction(SIGINT, &opts->sigint_saved, NULL);
+            sigaction(SIGTSTP, &opts->sigtstp_saved, NULL);
+            sigaction(SIGTTOU, &opts->sigttou_saved, NULL);
+            sigprocmask(SIG_SETMASK, &opts->sigmask_saved, NULL);
+
+            // connect the pipeline - file redirections below take precedence
+            if (in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1) _exit(1);
+            if (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1) _exit(1);
+
+            // perform file redirection
+            if (redir_apply(stage) == -1) _exit(1);
+
+            // built-in stages run in the forked child without exec - drop the shell's other (close-on-exec) fds as
+            // exec would, or this stage would hold its own output pipe open
+            if (builtin) {
+                close_range(STDERR_FILENO + 1, ~0U, 0);
+                _exit(ztee(exec_arr + 1));
+            }
+
+            // execute command in the child process
+            environ = stage->env;
+            if ((path ? execv(path, exec_arr) : execvp(exec_arr[0], exec_arr)) == -1) {
+                //fprintf(stderr, "Error executing command %s in child process\n", exec_arr[0]);
+                _exit(1);
+            }
+            break;
+    }
+    return child_pid;
+}
+
+/**
+ * Launches the command with posix_spawnp - the file actions do the same pipe and file redirections as the forked
+ * child and the spawn attributes put SIGINT/SIGTSTP back to default where they were at startup and set the process
+ * group.
+ * @return - pid of the child, or -1 if it could not be spawned (the caller falls back to fork)
+ */
+pid_t spawn_command(struct sh_options *opts, struct stage *stage, char const *path, int in_fd, int out_fd, pid_t pgid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    pid_t child_pid = -1;
+    char **exec_arr = stage->exec_arr;
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+
+    if (exec_arr[0] == NULL) return -1;
+    if (posix_spawn_file_actions_init(&actions) != 0) return -1;
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    // connect the pipeline
+    int success = 0;
+    if (in_fd != -1) success = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd != -1 && success == 0) success = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+    // perform file redirection - the same operations redir_apply does in a forked child
+    for (int r = 0; r < stage->redir_len && success == 0; r++) {
+        struct redir const *op = &stage->redir[r];
+        if (op->type == REDIR_OPEN) {
+            success = posix_spawn_file_actions_addopen(&actions, op->fd, op->path, op->flags, 0777);
+        } else {
+            int from = op->type == REDIR_DUP ? op->dup_fd : stage->here_fd;
+            success = posix_spawn_file_actions_adddup2(&actions, from, op->fd);
+        }
+    }
+
+    // reset signals - anything ignored at startup stays ignored, caught handlers reset on exec by themselves, and
+    // the startup signal mask comes back
+    sigemptyset(&defaults);
+    if (opts->sigint_saved.sa_handler == SIG_DFL) sigaddset(&defaults, SIGINT);
+    if (opts->sigtstp_saved.sa_handler == SIG_DFL) sigaddset(&defaults, SIGTSTP);
+    if (opts->sigttou_saved.sa_handler == SIG_DFL) sigaddset(&defaults, SIGTTOU);
+    if (success == 0) success = posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (success == 0) success = posix_spawnattr_setsigmask(&attr, &opts->sigmask_saved);
+    if (opts->job_control) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        if (success == 0) success = posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    if (success == 0) success = posix_spawnattr_setflags(&attr, flags);
+
+    // a cached path skips the $PATH walk
+    if (success == 0) {
+        success = path ? posix_spawn(&child_pid, path, &actions, &attr, exec_arr, stage->env)
+                       : posix_spawnp(&child_pid, exec_arr[0], &actions, &attr, exec_arr, stage->env);
+        if (success != 0) {
+            child_pid = -1;
+            METRIC_ADD(spawn_failures, 1);
+        }
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return child_pid;
+}
+
+/**
+ * Moves exactly n bytes from the pipe in_fd to out_fd with splice(2) - targets that refuse it (terminals, O_APPEND
+ * files) are written through buf instead.
+ * @return - 0 on success, -1 if the data could not be moved
+ */
+int splice_all(int in_fd, int out_fd, ssize_t n, char *buf) {
+    for (ssize_t moved; n > 0; n -= moved) {
+        moved = splice(in_fd, NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+        if (moved == -1 && errno == EINVAL) {
+            moved = read(in_fd, buf, n > 65536 ? 65536 : n);
+            if (moved > 0 && write(out_fd, buf, moved) != moved) return -1;
+        }
+        if (moved <= 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Built-in "ztee [-a] FILE..." pipeline stage - copies stdin to stdout and to every FILE. When stdin is a pipe the data
+ * is duplicated with tee(2) into one private pipe per file and moved on with splice(2), so it never passes through
+ * user space; otherwise (or where the kernel refuses to splice) it falls back to read/write.
+ * @return - exit status for the stage
+ */
+int ztee(char *files[]) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    if (files[0] != NULL && strcmp("-a", files[0]) == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        files++;
+    }
+    int n_files = 0;
+    while (files[n_files] != NULL) n_files++;
+
+    int out_fds[n_files + 1];
+    int tee_fds[n_files + 1][2];
+    for (int f = 0; f < n_files; f++) {
+        out_fds[f] = open(files[f], flags, 0777);
+        if (out_fds[f] == -1) {
+            fprintf(stderr, "ztee: %s: %s\n", files[f], strerror(errno));
+            return 1;
+        }
+        if (pipe2(tee_fds[f], O_CLOEXEC) == -1) return 1;
+    }
+
+    struct stat st;
+    int zero_copy = fstat(STDIN_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+    char buf[65536];
+    while (1) {
+        ssize_t n = 0;
+        if (zero_copy) {
+            // every private pipe has at least as many buffer slots as the bytes taken from stdin, so each tee()
+            // returns the full count
+            n = n_files > 0 ? tee(STDIN_FILENO, tee_fds[0][1], sizeof buf, 0)
+                            : splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, sizeof buf, SPLICE_F_MOVE);
+            // without files stdout itself may refuse splice - copy from here on
+            if (n == -1 && errno == EINVAL) {
+                zero_copy = 0;
+                continue;
+            }
+            if (n <= 0) break;
+            for (int f = 1; f < n_files; f++) {
+                if (tee(STDIN_FILENO, tee_fds[f][1], n, 0) != n) return 1;
+            }
+            for (int f = 0; f < n_files; f++) {
+                if (splice_all(tee_fds[f][0], out_fds[f], n, buf) != 0) return 1;
+            }
+            // consume the input
+            if (n_files > 0 && splice_all(STDIN_FILENO, STDOUT_FILENO, n, buf) != 0) return 1;
+        } else {
+            n = read(STDIN_FILENO, buf, sizeof buf);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) break;
+            for (int f = 0; f < n_files; f++) {
+                if (write(out_fds[f], buf, n) != n) return 1;
+            }
+            if (write(STDOUT_FILENO, buf, n) != n) return 1;
+        }
+    }
+    return 0;
+}
+
+// commands run inside the shell process - kept sorted by name for bsearch
+struct builtin const builtins[] = {
+    {"[", test_builtin},
+    {"echo", echo_builtin},
+    {"false", false_builtin},
+    {"kill", kill_builtin},
+    {"printf", printf_builtin},
+    {"pwd", pwd_builtin},
+    {"test", test_builtin},
+    {"true", true_builtin},
+};
+
+static int builtin_cmp(void const *name, void const *entry) {
+    return strcmp(name, ((struct builtin const *) entry)->name);
+}
+
+/**
+ * Finds the in-process version of a command.  Only bare names match, so an explicit path such as /bin/echo always
+ * runs the program itself, and so does everything while POSIXLY_CORRECT is exported.
+ * @return - table entry, or NULL if the command has to be launched
+ */
+struct builtin const *builtin_find(struct var_table *vars, char const *name) {
+    struct var *posix = var_find(vars, "POSIXLY_CORRECT", 15);
+    if (name == NULL || (posix != NULL && posix->exported)) return NULL;
+    return bsearch(name, builtins, sizeof builtins / sizeof builtins[0], sizeof builtins[0], builtin_cmp);
+}
+
+/**
+ * Runs a lone foreground command in the shell process - the stage's redirections are applied to the shell's own
+ * stdin/stdout (saved on close-on-exec descriptors) and put back afterwards, so nothing is forked or exec'd.
+ * @return - exit status, or BUILTIN_EXTERNAL if the command must be launched after all (nothing has been written)
+ */
+int run_builtin(struct builtin const *b, struct stage *stage) {
+    int saved[3] = {-1, -1, -1};
+    int status = 0;
+    int argc = 0;
+    while (stage->exec_arr[argc] != NULL) argc++;
+
+    // descriptors past stderr would clobber the shell's own - only the real program gets those
+    for (int r = 0; r < stage->redir_len; r++) {
+        struct redir const *op = &stage->redir[r];
+        if (op->fd > STDERR_FILENO || (op->type == REDIR_DUP && op->dup_fd > STDERR_FILENO)) return BUILTIN_EXTERNAL;
+    }
+
+    // same redirections as the child would get - an unusable file is status 1 as before
+    fflush(stdout);
+    status = redir_save(stage, saved);
+    if (status == 0) status = b->run(argc, stage->exec_arr);
+    if (status != BUILTIN_EXTERNAL && fflush(stdout) == EOF) {
+        fprintf(stderr, "%s: write error: %s\n", stage->exec_arr[0], strerror(errno));
+        status = 1;
+    }
+    // a failed write must not reach the shell's own stdout later
+    __fpurge(stdout);
+    clearerr(stdout);
+
+    redir_restore(saved);
+    return status;
+}
+
+/**
+ * Applies a stage's redirections of stdin, stdout and stderr to the shell itself, in order, keeping the descriptors
+ * they replace in saved (close-on-exec, -1 for untouched) for redir_restore
+ * @return - 0 on success, 1 at the first one that failed
+ */
+int redir_save(struct stage const *stage, int saved[3]) {
+    for (int r = 0; r < stage->redir_len; r++) {
+        struct redir const *op = &stage->redir[r];
+        int fd = op->fd;
+        if (saved[fd] == -1) saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+        int file_fd = op->type == REDIR_OPEN ? open(op->path, op->flags | O_CLOEXEC, 0777)
+                    : dup(op->type == REDIR_DUP ? op->dup_fd : stage->here_fd);
+        int failed = saved[fd] == -1 || file_fd == -1 || dup2(file_fd, fd) == -1;
+        if (file_fd != -1) close(file_fd);
+        if (failed) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Puts back the descriptors redir_save replaced
+ */
+void redir_restore(int saved[3]) {
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+        if (saved[fd] == -1) continue;
+        dup3(saved[fd], fd, 0);
+        close(saved[fd]);
+    }
+}
+
+/**
+ * true [ignored...]
+ */
+int true_builtin(int argc, char *argv[]) {
+    if (argc == 2 && (strcmp("--help", argv[1]) == 0 || strcmp("--version", argv[1]) == 0)) return BUILTIN_EXTERNAL;
+    return 0;
+}
+
+/**
+ * false [ignored...]
+ */
+int false_builtin(int argc, char *argv[]) {
+    if (argc == 2 && (strcmp("--help", argv[1]) == 0 || strcmp("--version", argv[1]) == 0)) return BUILTIN_EXTERNAL;
+    return 1;
+}
+
+/**
+ * echo [-neE]... [STRING]... - GNU echo: leading words made only of n, e and E are options, -e enables the
+ * \\ \a \b \c \e \f \n \r \t \v \0NNN \NNN \xHH escapes
+ */
+int echo_builtin(int argc, char *argv[]) {
+    int newline = 1, escapes = 0, a = 1;
+    if (argc == 2 && (strcmp("--help", argv[1]) == 0 || strcmp("--version", argv[1]) == 0)) return BUILTIN_EXTERNAL;
+    for (; a < argc && argv[a][0] == '-' && argv[a][1] != '\0'; a++) {
+        if (argv[a][strspn(argv[a] + 1, "neE") + 1] != '\0') break;
+        for (char const *o = argv[a] + 1; *o; o++) {
+            if (*o == 'n') newline = 0;
+            else escapes = *o == 'e';
+        }
+    }
+
+    for (; a < argc; a++) {
+        for (char const *s = argv[a]; *s; s++) {
+            unsigned char c = *s;
+            if (escapes && c == '\\' && s[1] != '\0') {
+                switch (c = *++s) {
+                    case 'a': c = '\a'; break;
+                    case 'b': c = '\b'; break;
+                    case 'c': return 0;
+                    case 'e': c = '\x1b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'n': c = '\n'; break;
+                    case 'r': c = '\r'; break;
+                    case 't': c = '\t'; break;
+                    case 'v': c = '\v'; break;
+                    case '\\': break;
+                    case 'x':
+                        if (!isxdigit((unsigned char) s[1])) {
+                            putchar('\\');
+                            break;
                         }
-                        r++;
-                        } else if (strcmp(">>", redir_arr[r]) == 0) {
-                        // open for appending
-                        append_fd = open(redir_arr[r + 1], O_WRONLY | O_APPEND | O_CREAT, 0777);
-                        if (append_fd == -1) {
-                            //fprintf(stderr, "Error opening file for appending %s \n", append);
-                            exit(1);
+                        c = 0;
+                        for (int d = 0; d < 2 && isxdigit((unsigned char) s[1]); d++) {
+                            s++;
+                            c = c * 16 + (isdigit((unsigned char) *s) ? *s - '0' : tolower(*s) - 'a' + 10);
                         }
-                        // redirect to stdout
-                        success = dup2(append_fd, STDOUT_FILENO);
-                        if (success == -1) {
-                            //fprintf(stderr, "Error redirecting file for appending %s \n", append);
-                            exit(1);
+                        break;
+                    case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+                        // \0 takes up to three more digits, \1 to \7 up to two
+                        c = c == '0' ? 0 : c - '0';
+                        for (int d = *s == '0' ? 0 : 1; d < 3 && s[1] >= '0' && s[1] <= '7'; d++) {
+                            c = c * 8 + *++s - '0';
                         }
-                        r++;
+                        break;
+                    default:
+                        putchar('\\');
+                        break;
+                }
+            }
+            putchar(c);
+        }
+        if (a + 1 < argc) putchar(' ');
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+/**
+ * One backslash escape of a printf format (octal_0 false) or of a %b argument (octal_0 true, where \0NNN is octal)
+ * @return - characters used after the backslash, or -1 if the real printf has to deal with it
+ */
+static int printf_escape(FILE *out, char const *esc, int octal_0, int *stop) {
+    static char const names[] = "\"\\abcefnrtv";
+    static char const codes[] = "\"\\\a\b\0\x1b\f\n\r\t\v";
+    char const *p = esc + 1;
+    int value = 0, len;
+    if (*p == 'x') {
+        for (len = 0, p++; len < 2 && isxdigit((unsigned char) *p); len++, p++) {
+            value = value * 16 + (isdigit((unsigned char) *p) ? *p - '0' : (tolower(*p) - 'a' + 10));
+        }
+        if (len == 0) return -1;
+        putc(value, out);
+    } else if (*p >= '0' && *p <= '7') {
+        if (octal_0 && *p == '0') p++;
+        for (len = 0; len < 3 && *p >= '0' && *p <= '7'; len++, p++) value = value * 8 + *p - '0';
+        putc(value, out);
+    } else if (*p != '\0' && strchr(names, *p) != NULL) {
+        if (*p == 'c') *stop = 1;
+        else putc(codes[strchr(names, *p) - names], out);
+        p++;
+    } else if (*p == 'u' || *p == 'U') {
+        // unicode escapes depend on the locale the real printf loads
+        return -1;
+    } else {
+        putc('\\', out);
+        if (*p != '\0') putc(*p++, out);
+    }
+    return p - esc - 1;
+}
+
+/**
+ * Integer printf argument - a leading ' or " gives the code of the next character
+ * @return - 0, or -1 if it is not exactly one number (the real printf reports it)
+ */
+static int printf_int(char const *arg, int is_signed, intmax_t *value) {
+    char *end;
+    if ((arg[0] == '\'' || arg[0] == '"') && arg[1] != '\0') {
+        *value = (unsigned char) arg[1];
+        return arg[2] == '\0' ? 0 : -1;
+    }
+    errno = 0;
+    *value = is_signed ? strtoimax(arg, &end, 0) : (intmax_t) strtoumax(arg, &end, 0);
+    return errno != 0 || *end != '\0' ? -1 : 0;
+}
+
+/**
+ * Prints the format once, taking conversions from argv
+ * @return - arguments used, or -1 if the real printf has to run instead
+ */
+static int printf_format(FILE *out, char const *format, int argc, char *argv[], int *stop) {
+    int used = 0;
+    for (char const *f = format; *f != '\0' && !*stop; f++) {
+        if (*f == '\\') {
+            int n = printf_escape(out, f, 0, stop);
+            if (n == -1) return -1;
+            f += n;
+            continue;
+        }
+        if (*f != '%') {
+            putc(*f, out);
+            continue;
+        }
+        if (*++f == '%') {
+            putc('%', out);
+            continue;
+        }
+        if (*f == 'b') {
+            for (char const *s = used < argc ? argv[used++] : ""; *s != '\0' && !*stop; s++) {
+                int n = *s == '\\' ? printf_escape(out, s, 1, stop) : (putc(*s, out), 0);
+                if (n == -1) return -1;
+                s += n;
+            }
+            continue;
+        }
+
+        // rebuild the directive for the C library with any * filled in and intmax_t arguments
+        char spec[64] = "%";
+        size_t len = 1;
+        int alt = 0, zero = 0, precision = 0;
+        intmax_t n;
+        for (; *f != '\0' && strchr("-+ #0", *f) != NULL; f++) {
+            alt |= *f == '#';
+            zero |= *f == '0';
+            if (len == 8) return -1;
+            spec[len++] = *f;
+        }
+        if (*f == '*') {
+            f++;
+            if (printf_int(used < argc ? argv[used++] : "", 1, &n) == -1 || n < INT_MIN || n > INT_MAX) return -1;
+            len += snprintf(spec + len, 16, "%jd", n);
+        }
+        for (; isdigit((unsigned char) *f) && len < 24; f++) spec[len++] = *f;
+        if (*f == '.') {
+            precision = 1;
+            if (*++f == '*') {
+                f++;
+                if (printf_int(used < argc ? argv[used++] : "", 1, &n) == -1 || n > INT_MAX) return -1;
+                // a negative precision counts as none
+                if (n >= 0) len += snprintf(spec + len, 16, ".%jd", n);
+            } else {
+                spec[len++] = '.';
+                for (; isdigit((unsigned char) *f) && len < 48; f++) spec[len++] = *f;
+            }
+        }
+        while (*f != '\0' && strchr("hlLjtz", *f) != NULL) f++;
+
+        // floating point and the ' flag are locale dependent, and what the real printf rejects is left to it too
+        if (*f == '\0' || strchr("diouxXcs", *f) == NULL || isdigit((unsigned char) *f) || len >= 48 ||
+            (alt && strchr("cdisu", *f) != NULL) || (zero && strchr("cs", *f) != NULL) || (precision && *f == 'c')) {
+            return -1;
+        }
+        char const *arg = used < argc ? argv[used++] : "";
+        if (strchr("cs", *f) != NULL) {
+            spec[len++] = *f;
+            spec[len] = '\0';
+            if ((*f == 'c' ? fprintf(out, spec, *arg) : fprintf(out, spec, arg)) < 0) return -1;
+        } else {
+            spec[len++] = 'j';
+            spec[len++] = *f;
+            spec[len] = '\0';
+            if (printf_int(arg, strchr("di", *f) != NULL, &n) == -1 || fprintf(out, spec, n) < 0) return -1;
+        }
+    }
+    return used;
+}
+
+/**
+ * printf FORMAT [ARGUMENT]... - GNU printf for the integer, string and %b conversions.  The output is built in
+ * memory first so any case handed to the real printf (errors, floating point, unicode escapes) prints nothing here.
+ */
+int printf_builtin(int argc, char *argv[]) {
+    char *buf = NULL;
+    size_t size = 0;
+    int stop = 0, used = 0, a = 1;
+    if (a < argc && strcmp("--", argv[a]) == 0) a++;
+    if (a >= argc || (argv[a][0] == '-' && argv[a][1] != '\0' && a == 1)) return BUILTIN_EXTERNAL;
+    char const *format = argv[a++];
+
+    FILE *out = open_memstream(&buf, &size);
+    if (out == NULL) return BUILTIN_EXTERNAL;
+    // the format is reused until the arguments run out
+    do {
+        used = printf_format(out, format, argc - a, argv + a, &stop);
+        if (used > 0) a += used;
+    } while (used > 0 && a < argc && !stop);
+    // excess arguments get a warning from the real printf
+    if (fclose(out) != 0 || used == -1 || (a < argc && !stop)) {
+        free(buf);
+        return BUILTIN_EXTERNAL;
+    }
+    fwrite(buf, 1, size, stdout);
+    free(buf);
+    return 0;
+}
+
+/**
+ * pwd [-L|-P] - -P (the default) prints getcwd(), -L prints $PWD while it is absolute, free of . and .. and names the
+ * current directory
+ */
+int pwd_builtin(int argc, char *argv[]) {
+    int logical = 0;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp("-L", argv[a]) == 0) logical = 1;
+        else if (strcmp("-P", argv[a]) == 0) logical = 0;
+        else return BUILTIN_EXTERNAL;
+    }
+
+    char const *pwd = getenv("PWD");
+    struct stat dot, named;
+    if (logical && pwd != NULL && pwd[0] == '/' && strstr(pwd, "/./") == NULL && strstr(pwd, "/../") == NULL) {
+        size_t len = strlen(pwd);
+        int dots = (len >= 2 && strcmp(pwd + len - 2, "/.") == 0) || (len >= 3 && strcmp(pwd + len - 3, "/..") == 0);
+        if (!dots && stat(pwd, &named) == 0 && stat(".", &dot) == 0 && named.st_dev == dot.st_dev &&
+            named.st_ino == dot.st_ino) {
+            puts(pwd);
+            return 0;
+        }
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) return BUILTIN_EXTERNAL;
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
+
+/* test/[ parser state - argv[argc] is the first word past the expression, pos the word being looked at */
+struct test_state {
+    char **argv;
+    int argc, pos, external;
+};
+
+static bool test_posix(struct test_state *t, int n_args);
+static bool test_or(struct test_state *t);
+
+// word i of the expression, "" past the end (only reached once external is set)
+static char const *test_arg(struct test_state *t, int i) {
+    return i < t->argc ? t->argv[i] : "";
+}
+
+static void test_advance(struct test_state *t, bool need_more) {
+    t->pos++;
+    if (need_more && t->pos >= t->argc) t->external = 1;
+}
+
+static bool test_unop(char const *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefghkLNOprSstuwxzG", op[1]) != NULL;
+}
+
+static bool test_binop(char const *op) {
+    static char const *const ops[] = {"=", "!=", "==", "-nt", "-ot", "-ef", "-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (size_t o = 0; o < sizeof ops / sizeof ops[0]; o++) {
+        if (strcmp(ops[o], op) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * Checks an integer operand - blanks around an optionally signed run of digits
+ * @return - start of the number, or NULL (test reports the invalid integer)
+ */
+static char const *test_int(char const *s) {
+    while (isblank((unsigned char) *s)) s++;
+    char const *start = *s == '+' ? ++s : s;
+    if (*s == '-') s++;
+    if (!isdigit((unsigned char) *s)) return NULL;
+    while (isdigit((unsigned char) *s)) s++;
+    while (isblank((unsigned char) *s)) s++;
+    return *s == '\0' ? start : NULL;
+}
+
+// compares two numbers from test_int of any length
+static int test_intcmp(char const *a, char const *b) {
+    int neg_a = *a == '-', neg_b = *b == '-';
+    a += neg_a;
+    b += neg_b;
+    while (*a == '0') a++;
+    while (*b == '0') b++;
+    size_t len_a = strspn(a, "0123456789"), len_b = strspn(b, "0123456789");
+    if (len_a == 0 && len_b == 0) return 0;
+    if (neg_a != neg_b) return neg_a ? -1 : 1;
+    int cmp = len_a != len_b ? (len_a < len_b ? -1 : 1) : strncmp(a, b, len_a);
+    cmp = cmp < 0 ? -1 : cmp > 0;
+    return neg_a ? -cmp : cmp;
+}
+
+static bool test_mtime(char const *path, struct timespec *ts) {
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+    *ts = st.st_mtim;
+    return true;
+}
+
+static int timespec_cmp(struct timespec a, struct timespec b) {
+    if (a.tv_sec != b.tv_sec) return a.tv_sec < b.tv_sec ? -1 : 1;
+    return a.tv_nsec < b.tv_nsec ? -1 : a.tv_nsec > b.tv_nsec;
+}
+
+// FILE1 OP FILE2, INT1 OP INT2 or STRING1 OP STRING2 at pos
+static bool test_binary(struct test_state *t) {
+    char const *left = test_arg(t, t->pos), *op = test_arg(t, t->pos + 1), *right = test_arg(t, t->pos + 2);
+    struct timespec lt, rt;
+    struct stat ls, rs;
+    bool le, re;
+    // "-l STRING" operands are left to the real test
+    if (t->pos + 1 < t->argc - 2 && strcmp("-l", right) == 0) t->external = 1;
+    t->pos += 3;
+
+    if (strcmp("-nt", op) == 0) {
+        le = test_mtime(left, &lt);
+        re = test_mtime(right, &rt);
+        return le && (!re || timespec_cmp(lt, rt) > 0);
+    }
+    if (strcmp("-ot", op) == 0) {
+        le = test_mtime(left, &lt);
+        re = test_mtime(right, &rt);
+        return re && (!le || timespec_cmp(lt, rt) < 0);
+    }
+    if (strcmp("-ef", op) == 0) {
+        return stat(left, &ls) == 0 && stat(right, &rs) == 0 && ls.st_dev == rs.st_dev && ls.st_ino == rs.st_ino;
+    }
+    if (strcmp("!=", op) == 0) return strcmp(left, right) != 0;
+    if (op[0] == '=') return strcmp(left, right) == 0;
+
+    // -eq -ne -lt -le -gt -ge
+    char const *l = test_int(left), *r = test_int(right);
+    if (l == NULL || r == NULL) {
+        t->external = 1;
+        return false;
+    }
+    int cmp = test_intcmp(l, r);
+    bool or_equal = op[2] == 'e';
+    return op[1] == 'l' ? cmp < or_equal : op[1] == 'g' ? cmp > -or_equal : (cmp != 0) == or_equal;
+}
+
+// -X OPERAND at pos
+static bool test_unary(struct test_state *t) {
+    char op = test_arg(t, t->pos)[1];
+    test_advance(t, true);
+    char const *arg = test_arg(t, t->pos++);
+    struct stat st;
+    if (t->external) return false;
+
+    switch (op) {
+        case 'e': return stat(arg, &st) == 0;
+        case 'r': return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+        case 'w': return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+        case 'x': return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+        case 'O': return stat(arg, &st) == 0 && geteuid() == st.st_uid;
+        case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+        case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+        case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+        case 'S': return stat(arg, &st) == 0 && S_ISSOCK(st.st_mode);
+        case 'c': return stat(arg, &st) == 0 && S_ISCHR(st.st_mode);
+        case 'b': return stat(arg, &st) == 0 && S_ISBLK(st.st_mode);
+        case 'p': return stat(arg, &st) == 0 && S_ISFIFO(st.st_mode);
+        case 'L':
+        case 'h': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'u': return stat(arg, &st) == 0 && (st.st_mode & S_ISUID);
+        case 'g': return stat(arg, &st) == 0 && (st.st_mode & S_ISGID);
+        case 'k': return stat(arg, &st) == 0 && (st.st_mode & S_ISVTX);
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 't': {
+            char const *fd = test_int(arg);
+            if (fd == NULL) break;
+            errno = 0;
+            long n = strtol(fd, NULL, 10);
+            return errno != ERANGE && n >= 0 && n <= INT_MAX && isatty(n);
+        }
+    }
+    // -G and -N (group membership, access times) are left to the real test
+    t->external = 1;
+    return false;
+}
+
+// [!]... ( EXPRESSION ) | UNARY | BINARY | STRING
+static bool test_term(struct test_state *t) {
+    bool invert = false, value;
+    if (t->pos >= t->argc) t->external = 1;
+    while (!t->external && strcmp("!", test_arg(t, t->pos)) == 0) {
+        test_advance(t, true);
+        invert = !invert;
+    }
+    if (t->external) return false;
+
+    if (strcmp("(", test_arg(t, t->pos)) == 0) {
+        int n_args;
+        test_advance(t, true);
+        for (n_args = 1; t->pos + n_args < t->argc && strcmp(")", t->argv[t->pos + n_args]) != 0; n_args++) {
+            if (n_args == 4) {
+                n_args = t->argc - t->pos;
+                break;
+            }
+        }
+        value = test_posix(t, n_args);
+        if (t->pos >= t->argc || strcmp(")", t->argv[t->pos]) != 0) t->external = 1;
+        test_advance(t, false);
+    } else if (t->argc - t->pos >= 4 && strcmp("-l", test_arg(t, t->pos)) == 0 &&
+               test_binop(test_arg(t, t->pos + 2))) {
+        t->external = 1;
+        value = false;
+    } else if (t->argc - t->pos >= 3 && test_binop(test_arg(t, t->pos + 1))) {
+        value = test_binary(t);
+    } else if (test_arg(t, t->pos)[0] == '-' && test_arg(t, t->pos)[1] != '\0' && test_arg(t, t->pos)[2] == '\0') {
+        if (!test_unop(test_arg(t, t->pos))) t->external = 1;
+        value = !t->external && test_unary(t);
+    } else {
+        value = test_arg(t, t->pos)[0] != '\0';
+        test_advance(t, false);
+    }
+    return value ^ invert;
+}
+
+static bool test_and(struct test_state *t) {
+    bool value = test_term(t);
+    while (!t->external && t->pos < t->argc && strcmp("-a", t->argv[t->pos]) == 0) {
+        test_advance(t, false);
+        value &= test_term(t);
+    }
+    return value;
+}
+
+static bool test_or(struct test_state *t) {
+    bool value = test_and(t);
+    while (!t->external && t->pos < t->argc && strcmp("-o", t->argv[t->pos]) == 0) {
+        test_advance(t, false);
+        value |= test_and(t);
+    }
+    return value;
+}
+
+// POSIX rules for 1 to 4 words, the full grammar beyond that
+static bool test_posix(struct test_state *t, int n_args) {
+    char const *first = test_arg(t, t->pos);
+    bool value;
+    if (t->external || n_args < 1) {
+        t->external = 1;
+        return false;
+    }
+    switch (n_args) {
+        case 1:
+            return test_arg(t, t->pos++)[0] != '\0';
+        case 2:
+            if (strcmp("!", first) == 0) {
+                test_advance(t, false);
+                return !test_posix(t, 1);
+            }
+            if (test_unop(first)) return test_unary(t);
+            t->external = 1;
+            return false;
+        case 3:
+            if (test_binop(test_arg(t, t->pos + 1))) return test_binary(t);
+            if (strcmp("!", first) == 0) {
+                test_advance(t, true);
+                return !test_posix(t, 2);
+            }
+            if (strcmp("(", first) == 0 && strcmp(")", test_arg(t, t->pos + 2)) == 0) {
+                test_advance(t, false);
+                value = test_posix(t, 1);
+                test_advance(t, false);
+                return value;
+            }
+            if (strcmp("-a", test_arg(t, t->pos + 1)) == 0 || strcmp("-o", test_arg(t, t->pos + 1)) == 0) {
+                return test_or(t);
+            }
+            t->external = 1;
+            return false;
+        case 4:
+            if (strcmp("!", first) == 0) {
+                test_advance(t, true);
+                return !test_posix(t, 3);
+            }
+            if (strcmp("(", first) == 0 && strcmp(")", test_arg(t, t->pos + 3)) == 0) {
+                test_advance(t, false);
+                value = test_posix(t, 2);
+                test_advance(t, false);
+                return value;
+            }
+            return test_or(t);
+        default:
+            return test_or(t);
+    }
+}
+
+/**
+ * test EXPRESSION / [ EXPRESSION ] - GNU test semantics; syntax errors and the rarely used -G, -N and -l are left to
+ * the real program, which prints the diagnostic and exits 2
+ */
+int test_builtin(int argc, char *argv[]) {
+    if (strcmp("[", argv[0]) == 0) {
+        if (argc < 2 || strcmp("]", argv[argc - 1]) != 0) return BUILTIN_EXTERNAL;
+        if (argc == 2 && (strcmp("--help", argv[1]) == 0 || strcmp("--version", argv[1]) == 0)) {
+            return BUILTIN_EXTERNAL;
+        }
+        argc--;
+    }
+    if (argc < 2) return 1;
+
+    struct test_state t = {argv, argc, 1, 0};
+    bool value = test_posix(&t, argc - 1);
+    if (t.external || t.pos != argc) return BUILTIN_EXTERNAL;
+    return value ? 0 : 1;
+}
+
+/**
+ * Signal number for a kill option - a number, or a name with or without SIG in any case
+ * @return - the signal, or -1 if unknown
+ */
+static int kill_signal(char const *name) {
+    char *end;
+    if (isdigit((unsigned char) name[0])) {
+        long sig = strtol(name, &end, 10);
+        return *end == '\0' && sig < NSIG ? (int) sig : -1;
+    }
+    if (strncasecmp("SIG", name, 3) == 0) name += 3;
+    for (int sig = 1; sig < SIGRTMIN; sig++) {
+        char const *abbrev = sigabbrev_np(sig);
+        if (abbrev != NULL && strcasecmp(abbrev, name) == 0) return sig;
+    }
+    return -1;
+}
+
+/**
+ * kill [-SIGNAL | -s SIGNAL] [--] PID... - the procps forms that send signals, listing (-l, -L) and queueing (-q)
+ * run the real kill
+ */
+int kill_builtin(int argc, char *argv[]) {
+    int sig = SIGTERM, status = 0, a = 1;
+    if (a < argc && strcmp("-s", argv[a]) == 0) {
+        if (++a >= argc || (sig = kill_signal(argv[a])) == -1) return BUILTIN_EXTERNAL;
+        a++;
+    } else if (a < argc && argv[a][0] == '-' && argv[a][1] != '\0' && strcmp("--", argv[a]) != 0) {
+        if ((sig = kill_signal(argv[a] + 1)) == -1) return BUILTIN_EXTERNAL;
+        a++;
+    }
+    if (a < argc && strcmp("--", argv[a]) == 0) a++;
+    if (a >= argc) return BUILTIN_EXTERNAL;
+
+    // every pid is checked before any signal goes out
+    pid_t pids[argc];
+    for (int p = a; p < argc; p++) {
+        char const *digits = argv[p] + (argv[p][0] == '-');
+        char *end;
+        errno = 0;
+        long pid = strtol(argv[p], &end, 10);
+        if (!isdigit((unsigned char) digits[0]) || *end != '\0' || errno != 0 || pid != (pid_t) pid) {
+            return BUILTIN_EXTERNAL;
+        }
+        pids[p] = pid;
+    }
+    for (int p = a; p < argc; p++) {
+        if (kill(pids[p], sig) == -1) {
+            fprintf(stderr, "%s: (%jd): %s\n", argv[0], (intmax_t) pids[p], strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// benchmark state - NULL unless running with --bench, so the timing hooks cost one branch
+struct bench *bench = NULL;
+
+char const *bench_phase_names[BENCH_PHASES] = {"getline", "wordsplit", "expand", "parse_words", "spawn", "wait"};
+
+/**
+ * CLOCK_MONOTONIC in nanoseconds when benchmarking or exporting --metrics, 0 otherwise
+ */
+uint64_t bench_now(void) {
+    return bench || metrics_timing ? monotonic_ns() : 0;
+}
+
+/**
+ * Records one sample of phase lasting ns nanoseconds
+ */
+void bench_sample(enum bench_phase phase, uint64_t ns) {
+    if (!bench) return;
+    if (bench->len[phase] == bench->cap[phase]) {
+        size_t cap = bench->cap[phase] ? bench->cap[phase] * 2 : 1024;
+        void *tmp = realloc(bench->samples[phase], sizeof *bench->samples[phase] * cap);
+        if (!tmp) err(1, "realloc");
+        bench->samples[phase] = tmp;
+        bench->cap[phase] = cap;
+    }
+    bench->samples[phase][bench->len[phase]++] = ns;
+}
+
+/**
+ * Records a sample of phase that started at bench_now() time start, and adds it to the --metrics phase time (scaled
+ * up, only sampled lines are timed)
+ */
+void bench_record(enum bench_phase phase, uint64_t start) {
+    if (!bench && !metrics_timing) return;
+    uint64_t ns = bench_now() - start;
+    if (metrics_timing) METRIC_ADD(phase_ns[phase], ns * METRICS_SAMPLE);
+    if (!bench) return;
+    if (phase == BENCH_SPAWN || phase == BENCH_WAIT) bench->exec_ns += ns;
+    bench_sample(phase, ns);
+}
+
+/**
+ * Opens a benchmark workload: one of the canned workloads generated in memory, or else a script file
+ *   tiny - many tiny commands, long - lines of 8192 words, expand - heavy ${VAR} expansion,
+ *   background - many background jobs, builtin - tiny commands run in-process
+ * All but builtin run /bin/true, so spawn and wait are measured rather than skipped by the true builtin.
+ */
+FILE *bench_open(char const *workload) {
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *gen = open_memstream(&buf, &size);
+    if (!gen) err(1, "open_memstream");
+
+    if (strcmp("tiny", workload) == 0) {
+        for (int l = 0; l < 1000; l++) fprintf(gen, "/bin/true\n");
+    } else if (strcmp("long", workload) == 0) {
+        for (int l = 0; l < 100; l++) {
+            fprintf(gen, "/bin/true");
+            for (int w = 1; w < 8192; w++) fprintf(gen, " argument-%05d", w);
+            fprintf(gen, "\n");
+        }
+    } else if (strcmp("expand", workload) == 0) {
+        for (int l = 0; l < 1000; l++) {
+            fprintf(gen, "/bin/true ${HOME} ${PATH} $$ $? $! ${USER}:${SHELL} ${HOME}/${LOGNAME}.$$"
+                         " ${UNSET_VARIABLE}\n");
+        }
+    } else if (strcmp("background", workload) == 0) {
+        for (int l = 0; l < 200; l++) fprintf(gen, "/bin/true &\n");
+    } else if (strcmp("builtin", workload) == 0) {
+        for (int l = 0; l < 1000; l++) fprintf(gen, "true\n");
+    } else {
+        fclose(gen);
+        free(buf);
+        return fopen(workload, "re");
+    }
+    fclose(gen);
+    FILE *input = fmemopen(buf, size, "r");
+    if (!input) err(1, "fmemopen");
+    return input;
+}
+
+/**
+ * Starts the next replay of the workload, once every background job of this one has been reaped
+ * @return - 1 if another iteration starts, 0 when done
+ */
+int bench_rewind(struct sh_options *opts) {
+    int status;
+    pid_t pid;
+    while (opts->jobs.len > 0 && (pid = waitpid(-1, &status, 0)) > 0) job_remove(&opts->jobs, pid);
+    if (++bench->iteration >= bench->iterations) return 0;
+    rewind(opts->input);
+    opts->map_pos = 0;
+    return 1;
+}
+
+/**
+ * Compares two samples for qsort
+ */
+static int bench_cmp(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *) a, y = *(uint64_t const *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Writes count, p50, p99 and max per phase (nanoseconds, nearest rank) as CSV or JSON
+ */
+void bench_report(FILE *out, char const *workload) {
+    int json = bench->json;
+    if (json) fprintf(out, "{\"workload\": \"%s\", \"iterations\": %d, \"phases\": {", workload, bench->iterations);
+    else fprintf(out, "workload,phase,count,p50_ns,p99_ns,max_ns\n");
+    for (int p = 0; p < BENCH_PHASES; p++) {
+        size_t len = bench->len[p];
+        uint64_t *s = bench->samples[p];
+        uint64_t p50 = 0, p99 = 0, max = 0;
+        if (len > 0) {
+            qsort(s, len, sizeof *s, bench_cmp);
+            p50 = s[(len * 50 + 99) / 100 - 1];
+            p99 = s[(len * 99 + 99) / 100 - 1];
+            max = s[len - 1];
+        }
+        if (json) {
+            fprintf(out, "%s\n  \"%s\": {\"count\": %zu, \"p50_ns\": %ju, \"p99_ns\": %ju, \"max_ns\": %ju}",
+                    p ? "," : "", bench_phase_names[p], len, (uintmax_t) p50, (uintmax_t) p99, (uintmax_t) max);
+        } else {
+            fprintf(out, "%s,%s,%zu,%ju,%ju,%ju\n", workload, bench_phase_names[p], len, (uintmax_t) p50,
+                    (uintmax_t) p99, (uintmax_t) max);
+        }
+        free(s);
+    }
+    if (json) fprintf(out, "\n}}\n");
+    fflush(out);
+}
+
+// --metrics output - written only by the process that set it up, workers share the counters but not the file
+static struct {
+    char *path, *tmp;
+    int json;
+    pid_t pid;
+    uint64_t start_ns, last_ns, last_lines;
+} metrics_out;
+
+// counters - a private struct until --metrics maps the shared page, so the hooks never check for NULL
+static struct metrics metrics_local;
+struct metrics *metrics = &metrics_local;
+volatile sig_atomic_t metrics_due = 0;
+int metrics_timing = 0;
+
+/**
+ * SIGUSR1 and SIGALRM handler - the dump itself happens at the next line, wakeup or finished batch worker
+ */
+static void metrics_handler(int sig) {
+    (void) sig;
+    metrics_due = 1;
+}
+
+/**
+ * Moves the counters to a shared page and starts dumping them to path on SIGUSR1 and every interval seconds
+ * (0 for SIGUSR1 only), as Prometheus text or JSON. The file is replaced with rename, so readers never see half a
+ * dump.
+ */
+void metrics_init(char const *path, int json, int interval) {
+    void *page = mmap(NULL, sizeof *metrics, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) err(1, "mmap");
+    metrics = page;
+    metrics->timing = 1;
+    metrics_out.path = strdup(path);
+    if (metrics_out.path == NULL || asprintf(&metrics_out.tmp, "%s.tmp", path) == -1) err(1, "metrics");
+    metrics_out.json = json;
+    metrics_out.pid = getpid();
+    metrics_out.start_ns = metrics_out.last_ns = monotonic_ns();
+    metrics_signals(1);
+    if (interval > 0) {
+        struct itimerval every = {{interval, 0}, {interval, 0}};
+        setitimer(ITIMER_REAL, &every, NULL);
+    }
+}
+
+/**
+ * Installs the dump handler - restart keeps blocking calls going (the dump waits for the next line), the --serve
+ * accept loop takes the EINTR instead so it dumps while idle
+ */
+void metrics_signals(int restart) {
+    if (metrics_out.path == NULL) return;
+    struct sigaction action = {.sa_handler = metrics_handler, .sa_flags = restart ? SA_RESTART : 0};
+    sigfillset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGALRM, &action, NULL);
+}
+
+/**
+ * Counts a line about to run, picks whether its phases are timed and dumps the counters if a dump is due
+ */
+void metrics_line(struct sh_options *opts) {
+    uint64_t line_count = METRIC_ADD(lines, 1);
+    metrics_timing = metrics->timing && line_count % METRICS_SAMPLE == 0;
+    if (metrics_due) metrics_dump(opts);
+}
+
+/**
+ * Writes every counter and gauge to the --metrics file - lines_per_second covers the time since the previous dump
+ */
+void metrics_dump(struct sh_options *opts) {
+    metrics_due = 0;
+    if (metrics_out.path == NULL || getpid() != metrics_out.pid) return;
+    struct metrics m;
+    for (size_t w = 0; w < sizeof m / sizeof(uint64_t); w++) {
+        ((uint64_t *) &m)[w] = __atomic_load_n((uint64_t *) metrics + w, __ATOMIC_RELAXED);
+    }
+    uint64_t now = monotonic_ns();
+    double rate = (m.lines - metrics_out.last_lines) * 1e9 / (double) (now - metrics_out.last_ns + 1);
+    metrics_out.last_ns = now;
+    metrics_out.last_lines = m.lines;
+
+    struct {
+        char const *name, *type, *help;
+        double value;
+    } const values[] = {
+        {"lines_total", "counter", "Input lines run", m.lines},
+        {"commands_total", "counter", "Commands started, counting each pipeline stage and in-process builtin",
+         m.commands},
+        {"builtins_total", "counter", "Commands run in-process without fork or exec", m.builtins},
+        {"spawn_failures_total", "counter", "Commands posix_spawn could not start (fork or exec failures)",
+         m.spawn_failures},
+        {"background_started_total", "counter", "Background pipelines started", m.jobs_started},
+        {"background_finished_total", "counter", "Background pipelines reaped", m.jobs_finished},
+        {"background_jobs", "gauge", "Background pipelines running", opts->jobs.running},
+        {"background_processes", "gauge", "Background processes not yet reaped", opts->jobs.len},
+        {"background_queued", "gauge", "Background pipelines waiting for a jobs-max slot", opts->jobs.queue_len},
+        {"batch_running", "gauge", "Script lines running in -j workers", opts->batch.running},
+        {"reap_latency_max_seconds", "gauge", "Longest event loop wakeup to report of a finished background process",
+         m.reap_max_ns / 1e9},
+        {"lines_per_second", "gauge", "Lines run per second since the previous dump", rate},
+        {"uptime_seconds", "gauge", "Seconds since the shell started", (now - metrics_out.start_ns) / 1e9},
+    };
+
+    FILE *out = fopen(metrics_out.tmp, "we");
+    if (out == NULL) {
+        warn("%s", metrics_out.tmp);
+        return;
+    }
+    if (metrics_out.json) fprintf(out, "{");
+    for (size_t v = 0; v < sizeof values / sizeof *values; v++) {
+        if (metrics_out.json) {
+            fprintf(out, "%s\n  \"%s\": %.15g", v ? "," : "", values[v].name, values[v].value);
+        } else {
+            fprintf(out, "# HELP smallsh_%s %s.\n# TYPE smallsh_%s %s\nsmallsh_%s %.15g\n", values[v].name,
+                    values[v].help, values[v].name, values[v].type, values[v].name, values[v].value);
+        }
+    }
+    if (metrics_out.json) {
+        fprintf(out, ",\n  \"reap_latency_seconds\": {\"count\": %ju, \"sum\": %.9f},\n  \"phase_seconds_total\": {",
+                (uintmax_t) m.jobs_finished, m.reap_ns / 1e9);
+        for (int p = 0; p < BENCH_PHASES; p++) {
+            fprintf(out, "%s\"%s\": %.9f", p ? ", " : "", bench_phase_names[p], m.phase_ns[p] / 1e9);
+        }
+        fprintf(out, "}\n}\n");
+    } else {
+        fprintf(out, "# HELP smallsh_reap_latency_seconds Event loop wakeup to report of a finished background "
+                     "process.\n# TYPE smallsh_reap_latency_seconds summary\n"
+                     "smallsh_reap_latency_seconds_sum %.9f\nsmallsh_reap_latency_seconds_count %ju\n",
+                m.reap_ns / 1e9, (uintmax_t) m.jobs_finished);
+        fprintf(out, "# HELP smallsh_phase_seconds_total Time spent per shell phase.\n"
+                     "# TYPE smallsh_phase_seconds_total counter\n");
+        for (int p = 0; p < BENCH_PHASES; p++) {
+            fprintf(out, "smallsh_phase_seconds_total{phase=\"%s\"} %.9f\n", bench_phase_names[p],
+                    m.phase_ns[p] / 1e9);
+        }
+    }
+    if (fclose(out) != 0 || rename(metrics_out.tmp, metrics_out.path) == -1) warn("%s", metrics_out.path);
+}
+
+/**
+ * Emits the buffered output of a finished ordered job and closes its buffers
+ */
+static void batch_emit(struct batch_job *job) {
+    int fds[2] = {job->out_fd, job->err_fd};
+    fflush(stdout);
+    for (int f = 0; f < 2; f++) {
+        if (fds[f] == -1) continue;
+        struct stat st;
+        off_t off = 0;
+        if (fstat(fds[f], &st) == 0) {
+            while (off < st.st_size && sendfile(f + 1, fds[f], &off, st.st_size - off) > 0);
+        }
+        close(fds[f]);
+    }
+}
+
+/**
+ * Blocks until one worker finishes, records its status and emits every job at the head of the queue that is done
+ * - in ordered mode that keeps the output in script order, otherwise the head is simply retired
+ */
+static void batch_reap(struct sh_options *opts) {
+    struct batch *b = &opts->batch;
+    // only the workers are waited for, through their pidfds - any other child of the parent is left to whoever
+    // started it. A worker without a pidfd is waited for directly.
+    struct pollfd fds[b->running > 0 ? b->running : 1];
+    struct batch_job *polled[b->running > 0 ? b->running : 1];
+    struct batch_job *blocking = NULL;
+    int n_fds = 0;
+    for (size_t q = 0; q < b->len && blocking == NULL; q++) {
+        struct batch_job *job = &b->queue[(b->head + q) % b->cap];
+        if (job->done) continue;
+        if (job->pidfd == -1) blocking = job;
+        polled[n_fds] = job;
+        fds[n_fds++] = (struct pollfd) {.fd = job->pidfd, .events = POLLIN};
+    }
+    if (blocking == NULL && n_fds > 0 && poll(fds, n_fds, -1) == -1 && errno != EINTR) err(1, "poll");
+    if (metrics_due) metrics_dump(opts);
+    for (int f = 0; f < n_fds; f++) {
+        struct batch_job *job = polled[f];
+        int status;
+        if (job != blocking && !(fds[f].revents & POLLIN)) continue;
+        if (waitpid(job->pid, &status, 0) != job->pid) continue;
+        job->done = 1;
+        job->status = WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status) + 128;
+        if (job->pidfd != -1) close(job->pidfd);
+        b->running--;
+    }
+    while (b->len > 0 && b->queue[b->head].done) {
+        struct batch_job *job = &b->queue[b->head];
+        batch_emit(job);
+        // the batch fails with the first failing line in script order
+        if (job->status != 0 && b->status == 0) b->status = job->status;
+        b->head = (b->head + 1) % b->cap;
+        b->len--;
+    }
+}
+
+/**
+ * Waits for every running line - the barrier before cd/exit and other built-ins that change the parent, and at the end
+ * of the script. $? becomes the aggregate status of the batch.
+ */
+void batch_drain(struct sh_options *opts) {
+    while (opts->batch.len > 0) batch_reap(opts);
+    opts->exit_status = opts->batch.status;
+}
+
+/**
+ * Runs the split line in a worker process once one of the -j slots is free
+ * @return - 1 if the line was taken, 0 if it has to run in the parent (after draining the running lines)
+ */
+int batch_dispatch(struct sh_options *opts) {
+    struct batch *b = &opts->batch;
+    if (opts->n_words == 0) return 1;
+
+    // the parent built-ins and variable assignments change the shell itself, so they act as barriers
+    size_t assignments = 0;
+    while (assignments < opts->n_words && var_name_len(words[assignments]) > 0) assignments++;
+    if (assignments == opts->n_words || parent_builtin_find(words[assignments]) != NULL) {
+        batch_drain(opts);
+        return 0;
+    }
+
+    while (b->running >= b->max_jobs) batch_reap(opts);
+    if (b->len == b->cap) {
+        // grow the ring, keeping the queue contiguous from the head
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        struct batch_job *queue = malloc(sizeof *queue * cap);
+        if (!queue) err(1, "malloc");
+        for (size_t q = 0; q < b->len; q++) queue[q] = b->queue[(b->head + q) % b->cap];
+        free(b->queue);
+        b->queue = queue;
+        b->cap = cap;
+        b->head = 0;
+    }
+
+    struct batch_job *job = &b->queue[(b->head + b->len) % b->cap];
+    *job = (struct batch_job) {.pidfd = -1, .out_fd = -1, .err_fd = -1};
+    if (b->ordered) {
+        job->out_fd = memfd_create("smallsh-stdout", MFD_CLOEXEC);
+        job->err_fd = memfd_create("smallsh-stderr", MFD_CLOEXEC);
+        if (job->out_fd == -1 || job->err_fd == -1) err(1, "memfd_create");
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    job->pid = fork();
+    switch (job->pid) {
+        case -1:
+            //fprintf(stderr, "Error creating fork");
+            exit(1);
+
+        // WORKER - expand, parse and execute the line like the parent would, then report its status
+        case 0:
+            // jobs started by this line are the worker's to wait for - keep them out of the shell's epoll set
+            opts->jobs.watch_fd = -1;
+            if (b->ordered) {
+                dup2(job->out_fd, STDOUT_FILENO);
+                dup2(job->err_fd, STDERR_FILENO);
+            }
+            expand_words(opts);
+            parse_words(opts);
+            fflush(stdout);
+            _exit(opts->exit_status);
+    }
+    job->pidfd = pidfd_open(job->pid, 0);
+    b->len++;
+    b->running++;
+    return 1;
+}
+
+/**
+ * Writes one frame - the header and payload go out in a single send. MSG_NOSIGNAL turns a closed connection into
+ * EPIPE instead of killing the process.
+ * @return - 0 on success, -1 if the connection is gone
+ */
+int frame_send(int fd, char type, void const *payload, uint32_t len) {
+    unsigned char header[FRAME_HEADER] = {type, len >> 24, len >> 16, len >> 8, len};
+    struct iovec iov[2] = {{header, sizeof header}, {(void *) payload, len}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    while (iov[0].iov_len + iov[1].iov_len > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        for (int v = 0; v < 2; v++) {
+            size_t step = (size_t) n < iov[v].iov_len ? (size_t) n : iov[v].iov_len;
+            iov[v].iov_base = (char *) iov[v].iov_base + step;
+            iov[v].iov_len -= step;
+            n -= step;
+        }
+        // skip a finished header so sendmsg never sees an empty first buffer with data after it
+        msg.msg_iov = iov[0].iov_len ? iov : iov + 1;
+        msg.msg_iovlen = iov[0].iov_len ? 2 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Reads one frame into *buf (grown as needed, NUL terminated)
+ * @return - payload length, -1 at end of stream, on a read error or a payload over FRAME_MAX
+ */
+ssize_t frame_recv(int fd, char *type, char **buf, size_t *cap) {
+    unsigned char header[FRAME_HEADER];
+    size_t got = 0, len = 0;
+    for (int part = 0; part < 2; part++) {
+        char *dst = part ? *buf : (char *) header;
+        size_t want = part ? len : sizeof header;
+        for (got = 0; got < want; ) {
+            ssize_t n = read(fd, dst + got, want - got);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            got += n;
+        }
+        if (part) break;
+        *type = (char) header[0];
+        len = (size_t) header[1] << 24 | header[2] << 16 | header[3] << 8 | header[4];
+        if (len > FRAME_MAX) return -1;
+        if (*cap < len + 1) {
+            char *tmp = realloc(*buf, len + 1);
+            if (!tmp) err(1, "realloc");
+            *buf = tmp;
+            *cap = len + 1;
+        }
+    }
+    (*buf)[len] = '\0';
+    return (ssize_t) len;
+}
+
+/* the connection a --serve worker answers on and the memfds holding the output of its current request */
+static struct {
+    int conn, out_fd, err_fd;
+    pid_t pid;  // the worker itself - children forked for $(...) or -j inherit the handler but must not answer
+} serve_conn = {-1, -1, -1, 0};
+
+/**
+ * Sends the captured stdout and stderr of the current request as FRAME_MAX sized frames, then its status
+ * @return - 0 on success, -1 if the client went away
+ */
+static int serve_reply(int status) {
+    int fds[2] = {serve_conn.out_fd, serve_conn.err_fd};
+    char const types[2] = {FRAME_STDOUT, FRAME_STDERR};
+    fflush(stdout);
+    fflush(stderr);
+    for (int f = 0; f < 2; f++) {
+        struct stat st;
+        if (fds[f] == -1 || fstat(fds[f], &st) == -1 || st.st_size == 0) continue;
+        char *out = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fds[f], 0);
+        if (out == MAP_FAILED) return -1;
+        int sent = 0;
+        for (off_t off = 0; sent == 0 && off < st.st_size; off += FRAME_MAX) {
+            size_t len = st.st_size - off < FRAME_MAX ? st.st_size - off : FRAME_MAX;
+            sent = frame_send(serve_conn.conn, types[f], out + off, len);
+        }
+        munmap(out, st.st_size);
+        if (sent == -1) return -1;
+    }
+    unsigned char code[4] = {(unsigned) status >> 24, (unsigned) status >> 16, (unsigned) status >> 8, status};
+    return frame_send(serve_conn.conn, FRAME_STATUS, code, sizeof code);
+}
+
+/**
+ * on_exit handler of a worker - exit and the fatal errors of parse_words still answer the request that ran them
+ */
+static void serve_exit(int status, void *arg) {
+    (void) arg;
+    if (serve_conn.conn != -1 && getpid() == serve_conn.pid) serve_reply(status);
+}
+
+/**
+ * Answers one connection - every FRAME_COMMAND holds whole lines, run like lines of a script with stdout and stderr
+ * going to fresh memfds, which are sent back before the status frame. The worker's opts is its own copy, so cd, $?,
+ * $! and background jobs belong to the connection. Background output written after its request was answered is lost.
+ */
+static void serve_connection(struct sh_options *opts, int conn) {
+    char *buf = NULL, type;
+    size_t cap = 0;
+    ssize_t len;
+    serve_conn.conn = conn;
+    serve_conn.pid = getpid();
+    opts->serving = 1;
+    on_exit(serve_exit, NULL);
+
+    while ((len = frame_recv(conn, &type, &buf, &cap)) != -1 && type == FRAME_COMMAND) {
+        int out_fd = memfd_create("smallsh-stdout", MFD_CLOEXEC);
+        int err_fd = memfd_create("smallsh-stderr", MFD_CLOEXEC);
+        if (out_fd == -1 || err_fd == -1) err(1, "memfd_create");
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+        close(serve_conn.out_fd);
+        close(serve_conn.err_fd);
+        serve_conn.out_fd = out_fd;
+        serve_conn.err_fd = err_fd;
+
+        // jobs that finished since the last request are reported in this one
+        if (opts->jobs.len > 0) wait_events(opts, 0);
+        job_queue_run(opts);
+
+        // read_line takes the lines from the payload, so here-documents take their body from the same frame
+        opts->text = buf;
+        opts->text_len = (size_t) len;
+        opts->text_pos = 0;
+        char const *line;
+        ssize_t line_len;
+        while ((line_len = read_line(opts, &line)) != -1) run_line(opts, line, line_len);
+        opts->text = NULL;
+
+        if (serve_reply(opts->exit_status) == -1) break;
+    }
+    serve_conn.conn = -1;
+    _exit(0);
+}
+
+/**
+ * Runs the command server on a Unix socket at path - a stale socket file is replaced. Each connection is answered by
+ * a worker forked from the idle server, so it starts with a clean shell state and costs no exec. Never returns.
+ */
+void serve(struct sh_options *opts, char const *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof addr.sun_path) errx(1, "socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) err(1, "socket");
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof addr) == -1) err(1, "%s", path);
+    if (listen(listen_fd, SOMAXCONN) == -1) err(1, "listen");
+
+    // commands never read the server's stdin, and finished workers are reaped by the kernel
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd != -1) {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+    struct sigaction reap = {.sa_handler = SIG_DFL, .sa_flags = SA_NOCLDWAIT}, sigchld_saved;
+    sigaction(SIGCHLD, &reap, &sigchld_saved);
+    metrics_signals(0);
+
+    while (1) {
+        if (metrics_due) metrics_dump(opts);
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            err(1, "accept");
+        }
+        fflush(stdout);
+        fflush(stderr);
+        switch (fork()) {
+            case -1:
+                warn("fork");
+                break;
+
+            // WORKER - a shell of its own for this connection
+            case 0:
+                close(listen_fd);
+                sigaction(SIGCHLD, &sigchld_saved, NULL);
+                metrics_signals(1);
+                opts->parent_pid = getpid();
+                events_init(opts);
+                serve_connection(opts, conn);
+        }
+        close(conn);
+    }
+}
+
+/**
+ * Connects to a --serve socket
+ * @return - the connected socket, -1 with a message on failure
+ */
+static int serve_connect(char const *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof addr.sun_path) {
+        warnx("socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+        warn("%s", path);
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sends one request and waits for its reply - output frames are written to out_fd and err_fd (-1 discards them)
+ * @return - the status of the request, -1 if the connection is gone
+ */
+static int serve_request(int fd, char const *command, size_t len, int out_fd, int err_fd) {
+    static char *buf = NULL;
+    static size_t cap = 0;
+    char type;
+    ssize_t n;
+    if (frame_send(fd, FRAME_COMMAND, command, len) == -1) return -1;
+    while ((n = frame_recv(fd, &type, &buf, &cap)) != -1) {
+        unsigned char *p = (unsigned char *) buf;
+        if (type == FRAME_STATUS && n == 4) return (int) ((uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+        int dst = type == FRAME_STDOUT ? out_fd : type == FRAME_STDERR ? err_fd : -1;
+        for (ssize_t off = 0, w; dst != -1 && off < n; off += w) {
+            w = write(dst, buf + off, n - off);
+            if (w == -1 && errno != EINTR) break;
+            if (w == -1) w = 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Client for --serve - sends every line of input as its own request and prints the replies as they come
+ * @return - exit status of the last request, 1 if the server could not be reached or hung up early
+ */
+int serve_client(char const *path, FILE *input) {
+    int fd = serve_connect(path);
+    if (fd == -1) return 1;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int status = -1;
+    while ((len = getline(&line, &cap, input)) != -1) {
+        if (len > FRAME_MAX) {
+            warnx("line longer than %d bytes", FRAME_MAX);
+            status = 1;
+            break;
+        }
+        // the server answers exit and fatal errors before it hangs up, so a hang up keeps the last status
+        int request_status = serve_request(fd, line, len, STDOUT_FILENO, STDERR_FILENO);
+        if (request_status == -1) break;
+        status = request_status;
+    }
+    free(line);
+    close(fd);
+    return status == -1 ? 1 : status;
+}
+
+/**
+ * Load test for --serve - each of the connections sends its share of the requests (command, one at a time, waiting
+ * for every reply) and the request rate and latencies (nearest rank, like --bench) of the answered requests are printed
+ * @return - 0 if every request was answered, 1 otherwise
+ */
+int serve_load(char const *path, char const *command, long requests, int connections) {
+    size_t len = strlen(command);
+    char *line = malloc(len + 2);
+    // each connection's latencies, then the number of them it completed
+    size_t size = sizeof(uint64_t) * (requests + connections);
+    uint64_t *lat = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (!line || lat == MAP_FAILED) err(1, "load test");
+    uint64_t *done = lat + requests;
+    memcpy(line, command, len);
+    strcpy(line + len, "\n");
+
+    fflush(stdout);
+    uint64_t start = monotonic_ns();
+    for (int c = 0; c < connections; c++) {
+        long first = requests * c / connections, last = requests * (c + 1) / connections;
+        switch (fork()) {
+            case -1:
+                err(1, "fork");
+
+            // CLIENT - one connection, latencies go straight into the shared array
+            case 0: {
+                int fd = serve_connect(path);
+                if (fd == -1) _exit(1);
+                for (long r = first; r < last; r++) {
+                    uint64_t sent = monotonic_ns();
+                    if (serve_request(fd, line, len + 1, -1, -1) == -1) _exit(1);
+                    lat[r] = monotonic_ns() - sent;
+                    done[c]++;
+                }
+                _exit(0);
+            }
+        }
+    }
+    int failed = 0, status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+
+    // a failed connection leaves the rest of its share unset - only the completed samples are ranked
+    long n = 0;
+    for (int c = 0; c < connections; c++) {
+        long first = requests * c / connections;
+        memmove(lat + n, lat + first, sizeof *lat * done[c]);
+        n += (long) done[c];
+    }
+    qsort(lat, n, sizeof *lat, bench_cmp);
+    printf("requests,connections,failed,seconds,req_per_s,p50_ns,p99_ns,max_ns\n");
+    printf("%ld,%d,%d,%.3f,%.0f,", requests, connections, failed, seconds, n / seconds);
+    if (n == 0) {
+        printf("n/a,n/a,n/a\n");
+    } else {
+        printf("%ju,%ju,%ju\n", (uintmax_t) lat[(n * 50 + 99) / 100 - 1], (uintmax_t) lat[(n * 99 + 99) / 100 - 1],
+               (uintmax_t) lat[n - 1]);
+    }
+    munmap(lat, size);
+    free(line);
+    return failed > 0;
+}
+
+/**
+ * Maps a regular script file for read_line - the input FILE stays open but unused
+ * @return - 1 if mapped, 0 to keep streaming (not a regular file, empty, or mmap failed)
+ */
+int map_script(struct sh_options *opts) {
+    struct stat st;
+    int fd = fileno(opts->input);
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return 0;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    opts->map = map;
+    opts->map_size = st.st_size;
+    opts->map_pos = 0;
+    opts->map_released = 0;
+    return 1;
+}
+
+/**
+ * Reads the next line from stdin with read(2) into opts->line_buf, handling events while it waits - jobs are
+ * reported as they finish (and the prompt shown again) and ^C abandons the line
+ * @return - length of the line including its newline, -1 at end of input or when interrupted (opts->error set)
+ */
+static ssize_t read_input(struct sh_options *opts, char const **line) {
+    // drop the line handed out last time
+    opts->input_len -= opts->input_start;
+    memmove(opts->line_buf, opts->line_buf + opts->input_start, opts->input_len);
+    opts->input_start = 0;
+
+    while (1) {
+        char const *nl = opts->input_len ? memchr(opts->line_buf, '\n', opts->input_len) : NULL;
+        if (nl != NULL || (opts->input_eof && opts->input_len > 0)) {
+            opts->input_start = nl ? (size_t) (nl - opts->line_buf) + 1 : opts->input_len;
+            *line = opts->line_buf;
+            return (ssize_t) opts->input_start;
+        }
+        if (opts->input_eof) return -1;
+
+        // the history index is built in slices while nothing else happens
+        int indexing = opts->input_polled && history_idle(&opts->history);
+        int ready = wait_events(opts, opts->input_polled && !indexing ? -1 : 0);
+        if (ready & EVENT_INTERRUPT) {
+            fprintf(stderr, "\n");
+            opts->error = 1;
+            return -1;
+        }
+        if ((ready & EVENT_JOBS) && opts->queue_safe) job_queue_run(opts);
+        if ((ready & EVENT_JOBS) && opts->interactive == 1) print_prompt(opts);
+        if (opts->input_polled && !(ready & EVENT_INPUT)) continue;
+
+        if (opts->line_cap - opts->input_len < 4096) {
+            size_t cap = opts->line_cap ? opts->line_cap * 2 : 8192;
+            char *tmp = realloc(opts->line_buf, cap);
+            if (!tmp) err(1, "realloc");
+            opts->line_buf = tmp;
+            opts->line_cap = cap;
+        }
+        ssize_t n = read(STDIN_FILENO, opts->line_buf + opts->input_len, opts->line_cap - opts->input_len);
+        if (n > 0) opts->input_len += n;
+        else if (n == 0 || (errno != EINTR && errno != EAGAIN)) opts->input_eof = 1;
+    }
+}
+
+/**
+ * Hands out the next line of size bytes at src in place, advancing *pos past it
+ * @return - length of the line including its newline, -1 past the end
+ */
+static ssize_t read_span(char const *src, size_t size, size_t *pos, char const **line) {
+    if (*pos >= size) return -1;
+    char const *start = src + *pos;
+    char const *nl = memchr(start, '\n', size - *pos);
+    size_t len = nl ? (size_t) (nl - start) + 1 : size - *pos;
+    *pos += len;
+    *line = start;
+    return (ssize_t) len;
+}
+
+/**
+ * Reads the next input line - in place from opts->text while it is set, then in place from the mapped script, from
+ * stdin through the event loop, otherwise with getline into opts->line_buf. Only getline lines are NUL terminated,
+ * so callers go by the returned length.
+ * @return - length of the line including its newline, -1 at end of input or on a read error
+ */
+ssize_t read_line(struct sh_options *opts, char const **line) {
+    if (opts->text) return read_span(opts->text, opts->text_len, &opts->text_pos, line);
+    if (opts->map == NULL && opts->input == stdin) return read_input(opts, line);
+    if (opts->map == NULL) {
+        ssize_t len = getline(&opts->line_buf, &opts->line_cap, opts->input);
+        *line = opts->line_buf;
+        return len;
+    }
+
+    // hand back pages of lines already run (every 8 MiB) so resident memory stays flat on huge scripts
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t done = opts->map_pos & ~(page - 1);
+    if (done - opts->map_released >= ((size_t) 8 << 20)) {
+        madvise(opts->map + opts->map_released, done - opts->map_released, MADV_DONTNEED);
+        opts->map_released = done;
+    }
+    return read_span(opts->map, opts->map_size, &opts->map_pos, line);
+}
+
+/**
+ * Splits command line entries into words - code from the professor
+ * Words are copied into one line_arena allocation: every word is shorter than the text it came from and its
+ * terminator takes the place of the following space, so len + 1 bytes always fit the whole line, and words is grown
+ * once to the most words the line can hold. The line does not
+ * need to be NUL terminated, so mapped script lines are split in place.
+ */
+size_t wordsplit(char const *line, size_t len) {
+    size_t wind = 0;
+    char *buf = arena_alloc(&line_arena, len + 1);
+    // every word takes at least one character and one separator
+    words_reserve(len / 2 + 1);
+
+    char const *c = line, *end = line + len;
+    for (;c < end && *c && isspace(*c); ++c); /* discard leading space */
+
+    for (; c < end && *c;) {
+        /* read a word */
+        if (*c == '#') break;
+        words[wind] = buf;
+        for (int depth = 0; c < end && *c && (depth > 0 ? *c != '\n' : !isspace(*c)); ++c) {
+            if (depth > 0) {
+                // $(...) is one word, kept as typed for the inner line's own wordsplit
+                if (*c == '\\' && c + 1 < end && c[1]) *buf++ = *c++;
+                else if (*c == '(') depth++;
+                else if (*c == ')') depth--;
+            } else if (*c == '$' && c + 1 < end && c[1] == '(') {
+                *buf++ = *c++;
+                depth = 1;
+            } else if (*c == '\\' && c + 1 < end && c[1]) ++c;
+            *buf++ = *c;
+        }
+        *buf++ = '\0';
+        ++wind;
+        for (;c < end && *c && isspace(*c); ++c);
+    }
+    return wind;
+}
+
+// operator words read_heredocs puts in place of << - the body follows, expanded or (quoted delimiter) as typed
+char heredoc_word[] = "<<", heredoc_raw_word[] = "<<";
+
+/**
+ * Collects the bodies of the line's here-documents - "<< DELIM" or "<<DELIM", with 'DELIM' or "DELIM" for a body that
+ * is not expanded. The following input lines up to DELIM become the word after the operator, so the body is expanded
+ * with the rest of the line and -j workers get it with the line.
+ */
+void read_heredocs(struct sh_options *opts) {
+    for (size_t i = 0; i < opts->n_words; i++) {
+        char *word = words[i];
+        if (strncmp("<<", word, 2) != 0 || word[2] == '<') continue;
+        if (word[2] == '\0' && i + 1 == opts->n_words) continue;
+
+        // "<<DELIM" becomes two words
+        if (word[2] != '\0') {
+            words_reserve(opts->n_words + 1);
+            memmove(&words[i + 2], &words[i + 1], (opts->n_words - i - 1) * sizeof words[0]);
+            words[i + 1] = word + 2;
+            opts->n_words++;
+        }
+        char *delim = words[i + 1];
+        size_t delim_len = strlen(delim);
+        int quoted = delim_len >= 2 && (delim[0] == '\'' || delim[0] == '"') && delim[delim_len - 1] == delim[0];
+        if (quoted) {
+            delim++;
+            delim_len -= 2;
+        }
+
+        // body lines up to the delimiter line
+        char const *line;
+        ssize_t len;
+        int found = 0;
+        build_str(NULL, NULL);
+        build_str("", NULL);
+        while (1) {
+            if (opts->interactive == 1 && opts->input == stdin) fprintf(stderr, "> ");
+            if ((len = read_line(opts, &line)) == -1) break;
+            size_t text_len = len > 0 && line[len - 1] == '\n' ? (size_t) len - 1 : (size_t) len;
+            if (text_len == delim_len && memcmp(line, delim, delim_len) == 0) {
+                found = 1;
+                break;
+            }
+            build_str(line, line + text_len);
+            build_str("\n", NULL);
+        }
+        if (!found) fprintf(stderr, "Here-document ended by end of input (wanted %.*s).\n", (int) delim_len, delim);
+        opts->error = 0;
+        words[i] = quoted ? heredoc_raw_word : heredoc_word;
+        words[i + 1] = arena_strdup(&line_arena, build_str(NULL, NULL));
+        i++;
+    }
+}
+
+/**
+ * Puts the text of the stage's last here-document or here-string (WORD plus a newline) where the child can read it
+ * without touching the filesystem - a pipe holds bodies up to PIPE_BUF, larger ones go to a memfd
+ * @return - read descriptor (close-on-exec), -1 if the stage has none
+ */
+int here_document(struct stage *stage) {
+    char const *text = NULL;
+    int here_string = 0;
+    for (int r = 0; r < stage->redir_len; r++) {
+        if (stage->redir[r].type != REDIR_HEREDOC && stage->redir[r].type != REDIR_HERESTRING) continue;
+        text = stage->redir[r].path;
+        here_string = stage->redir[r].type == REDIR_HERESTRING;
+    }
+    if (text == NULL) return -1;
+
+    size_t len = strlen(text);
+    int fds[2] = {-1, -1};
+    if (len + here_string <= PIPE_BUF) {
+        // fits the empty pipe, so the writes cannot block
+        if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+    } else {
+        fds[0] = fds[1] = memfd_create("smallsh-heredoc", MFD_CLOEXEC);
+        if (fds[0] == -1) return -1;
+    }
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = write(fds[1], text + off, len - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    if (here_string) write(fds[1], "\n", 1);
+    if (fds[1] != fds[0]) close(fds[1]);
+    else lseek(fds[0], 0, SEEK_SET);
+    return fds[0];
+}
+
+/**
+ * Runs the COMMAND of $(COMMAND) in a forked copy of the shell - the text goes through wordsplit, expand and
+ * parse_words like any line (so nested substitutions fork again) with stdout on a pipe. The parent reads the pipe
+ * straight into one doubling buffer, so capturing is linear in the output size. $? becomes COMMAND's status.
+ * @return - the output without trailing newlines, valid until the next substitution in this process
+ */
+char const *command_subst(struct sh_options *opts, char const *text, size_t len, size_t *out_len) {
+    static char *buf = NULL;
+    static size_t cap = 0;
+    size_t n = 0;
+    int fds[2];
+    *out_len = 0;
+    if (pipe2(fds, O_CLOEXEC) == -1) return "";
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    switch (pid) {
+        case -1:
+            close(fds[0]);
+            close(fds[1]);
+            return "";
+
+        // CHILD - the inner line stays in the shell's process group and out of its epoll set
+        case 0:
+            dup2(fds[1], STDOUT_FILENO);
+            opts->job_control = 0;
+            opts->jobs.watch_fd = -1;
+            opts->n_words = wordsplit(text, len);
+            expand_words(opts);
+            parse_words(opts);
+            fflush(stdout);
+            _exit(opts->exit_status);
+    }
+    close(fds[1]);
+
+    while (1) {
+        if (cap - n < 4096) {
+            size_t new_cap = cap ? cap * 2 : 16384;
+            char *tmp = realloc(buf, new_cap);
+            if (!tmp) err(1, "realloc");
+            buf = tmp;
+            cap = new_cap;
+        }
+        ssize_t got = read(fds[0], buf + n, cap - n);
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0) break;
+        n += got;
+    }
+    close(fds[0]);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+    opts->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status) + 128;
+    while (n > 0 && buf[n - 1] == '\n') n--;
+    *out_len = n;
+    return n ? buf : "";
+}
+
+/**
+ * Finds the parenthesis closing the one at s - backslash escaped parentheses do not count
+ * @return - pointer to the matching ')', NULL if there is none
+ */
+static char const *subst_end(char const *s) {
+    int depth = 0;
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) s++;
+        else if (*s == '(') depth++;
+        else if (*s == ')' && --depth == 0) return s;
+    }
+    return NULL;
+}
+
+/**
+ * Detects certain symbols in a word and records their start/end pointers - code from the professor
+ */
+char param_scan(char const *word, char const **start, char const **end) {
+    static char const *prev;
+    if (!word) word = prev;
+
+    char ret = 0;
+    *start = 0;
+    *end = 0;
+    for (char const *s = word; *s && !ret; ++s) {
+        s = strchr(s, '$');
+        if (!s) break;
+        switch (s[1]) {
+            case '$':
+            case '!':
+            case '?':
+                ret = s[1];
+                *start = s;
+                *end = s + 2;
+                break;
+            case '{':;
+                char *e = strchr(s + 2, '}');
+                if (e) {
+                    ret = s[1];
+                    *start = s;
+                    *end = e + 1;
+                }
+                break;
+            case '(':;
+                char const *close = subst_end(s + 1);
+                if (close) {
+                    ret = s[1];
+                    *start = s;
+                    *end = close + 1;
+                }
+                break;
+        }
+    }
+    prev = *end;
+    return ret;
+}
+
+/**
+ * String builder method for building up memory allocated strings - code from professor
+ * The buffer is kept between words and only grows (doubling), so expand() copies the finished word into line_arena.
+ */
+char *build_str(char const *start, char const *end) {
+    static size_t base_len = 0, base_cap = 0;
+    static char *base = 0;
+
+    if (!start) {
+        /* Reset; start a new base string in the same buffer, return the old one */
+        base_len = 0;
+        return base;
+    }
+    /* Append [start, end) to base string
+     * If end is NULL, append whole start string to base string.
+     * Returns the shared buffer, valid until the next reset.
+     */
+    size_t n = end ? (size_t) (end - start) : strlen(start);
+    if (base_len + n + 1 > base_cap) {
+        size_t newsize = base_cap ? base_cap : 64;
+        while (newsize < base_len + n + 1) newsize *= 2;
+        void *tmp = realloc(base, newsize);
+        if (!tmp) err(1, "realloc");
+        base = tmp;
+        base_cap = newsize;
+    }
+    memcpy(base + base_len, start, n);
+    base_len += n;
+    base[base_len] = '\0';
+
+    return base;
+}
+
+/**
+ * Method for replacing certain symbols with data -- template code from the professor
+ */
+char *expand(char const *word, struct sh_options *opts) {
+    char const *pos = word;
+    char const *start, *end;
+    // words without parameters are already in line_arena - nothing to build
+    if (!strchr(word, '$')) return (char *) word;
+    char c = param_scan(pos, &start, &end);
+    build_str(NULL, NULL);
+    build_str(pos, start);
+
+    while (c) {
+        // $! symbol - replace with pid of most recent background process OR "" if none
+        if (c == '!') {
+            if (opts->background_pid == 0) {
+                build_str("", NULL);
+            } else {
+                char bkg_pid_str[12] = {0};
+                sprintf(bkg_pid_str, "%d", opts->background_pid);
+                build_str(bkg_pid_str, NULL);
+                }
+            }
+        // $$ symbol - replace with pid of smallsh parent process
+        else if (c == '$') {
+            char pid_str[12] = {0};
+            sprintf(pid_str, "%d", opts->parent_pid);
+            build_str(pid_str, NULL);
+        // $? symbol - replace with the exit status of last foreground process OR "0" if none
+        } else if (c == '?') {
+            char status_str[12] = {0};
+            sprintf(status_str, "%d", opts->exit_status);
+            build_str(status_str, NULL);
+        // ${PARAM} - replace PARAM with the shell variable or "" if not set
+        } else if (c == '{') {
+            struct var *var = var_find(&opts->vars, start + 2, end - start - 3);
+            if (var == NULL) {
+                build_str("", NULL);
+            } else {
+                build_str(var->pair + var->name_len + 1, NULL);
+            }
+        // $(COMMAND) - replace with the output of COMMAND without its trailing newlines
+        } else if (c == '(') {
+            size_t out_len;
+            char const *out = command_subst(opts, start + 2, end - start - 3, &out_len);
+            build_str(out, out + out_len);
+        }
+        pos = end;
+        c = param_scan(pos, &start, &end);
+        build_str(pos, start);
+    }
+    return arena_strdup(&line_arena, build_str(start, NULL));
+}
+
+/**
+ * Parameter expansion of every word of the line, then pathname expansion - for the main loop, -j workers and $(...)
+ */
+void expand_words(struct sh_options *opts) {
+    for (size_t i = 0; i < opts->n_words; ++i) {
+        // quoted here-document bodies are taken as typed
+        if (i > 0 && words[i - 1] == heredoc_raw_word) continue;
+        //fprintf(stderr, "Word %zu: %s\n", i, words[i]);
+        words[i] = expand(words[i], opts);
+        //fprintf(stderr, "Expanded Word %zu: %s\n", i, words[i]);
+    }
+    glob_words(opts);
+}
+
+/**
+ * Copies len bytes of s into block_arena as a string
+ */
+static char *block_strndup(char const *s, size_t len) {
+    char *copy = arena_alloc(&block_arena, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+ * Compiles words[first..end) into t - each word is split at its $?, $!, ${NAME} and $(...) slots once, so running
+ * the line again only fills the slots in. $$ cannot change and is folded into the text.
+ */
+static void tmpl_compile(struct sh_options *opts, struct tmpl_line *t, size_t first, size_t end) {
+    t->n_words = end - first;
+    t->words = arena_alloc(&block_arena, sizeof *t->words * t->n_words);
+    t->glob = 0;
+    for (size_t i = first; i < end; i++) {
+        struct tmpl_word *w = &t->words[i - first];
+        char *word = words[i];
+        *w = (struct tmpl_word) {.text = word};
+        // here-document operators are told apart by address, quoted bodies are taken as typed
+        if (word == heredoc_word || word == heredoc_raw_word) continue;
+        if ((i > 0 && words[i - 1] == heredoc_raw_word) || !strchr(word, '$')) {
+            w->text = block_strndup(word, strlen(word));
+            t->glob |= strpbrk(word, "*?[") != NULL;
+            continue;
+        }
+
+        char const *copy = block_strndup(word, strlen(word)), *pos = copy, *start, *stop;
+        struct tmpl_part *parts = arena_alloc(&block_arena, sizeof *parts * (strlen(word) + 1));
+        size_t n = 0, slots = 0;
+        for (char c = param_scan(pos, &start, &stop); ; c = param_scan(pos, &start, &stop)) {
+            if (!c) start = pos + strlen(pos);
+            if (start > pos) parts[n++] = (struct tmpl_part) {SLOT_TEXT, pos, start - pos};
+            if (!c) break;
+            struct tmpl_part *part = &parts[n++];
+            *part = (struct tmpl_part) {SLOT_VAR, start + 2, stop - start - 3};
+            if (c == '?') part->type = SLOT_STATUS;
+            else if (c == '!') part->type = SLOT_BACKGROUND;
+            else if (c == '(') part->type = SLOT_SUBST;
+            else if (c == '$') {
+                char pid_str[12];
+                int len = snprintf(pid_str, sizeof pid_str, "%d", opts->parent_pid);
+                *part = (struct tmpl_part) {SLOT_TEXT, block_strndup(pid_str, len), len};
+            }
+            slots += part->type != SLOT_TEXT;
+            pos = stop;
+        }
+
+        // nothing left to fill in - the word is text after all
+        if (slots == 0) {
+            build_str(NULL, NULL);
+            build_str("", NULL);
+            for (size_t p = 0; p < n; p++) build_str(parts[p].text, parts[p].text + parts[p].len);
+            char *text = build_str("", NULL);
+            w->text = block_strndup(text, strlen(text));
+            t->glob |= strpbrk(text, "*?[") != NULL;
+            continue;
+        }
+        w->parts = parts;
+        w->n_parts = n;
+        // a slot's value may be a pattern
+        t->glob = 1;
+    }
+}
+
+/**
+ * Fills in the slots of a compiled word
+ * @return - the word, in line_arena unless it has no slots
+ */
+static char *tmpl_expand(struct sh_options *opts, struct tmpl_word const *w) {
+    if (w->n_parts == 0) return w->text;
+    build_str(NULL, NULL);
+    build_str("", NULL);
+    for (size_t p = 0; p < w->n_parts; p++) {
+        struct tmpl_part const *part = &w->parts[p];
+        char num[12];
+        switch (part->type) {
+            case SLOT_TEXT:
+                build_str(part->text, part->text + part->len);
+                break;
+            case SLOT_STATUS:
+                snprintf(num, sizeof num, "%d", opts->exit_status);
+                build_str(num, NULL);
+                break;
+            case SLOT_BACKGROUND:
+                if (opts->background_pid != 0) {
+                    snprintf(num, sizeof num, "%d", opts->background_pid);
+                    build_str(num, NULL);
+                }
+                break;
+            case SLOT_VAR: {
+                struct var *var = var_find(&opts->vars, part->text, part->len);
+                if (var != NULL) build_str(var->pair + var->name_len + 1, NULL);
+                break;
+            }
+            case SLOT_SUBST: {
+                size_t out_len;
+                char const *out = command_subst(opts, part->text, part->len, &out_len);
+                build_str(out, out + out_len);
+                break;
+            }
+        }
+    }
+    return arena_strdup(&line_arena, build_str("", NULL));
+}
+
+/**
+ * Puts the expanded words of a compiled line in words, globbed like expand_words would
+ */
+static void tmpl_words(struct sh_options *opts, struct tmpl_line const *t) {
+    opts->index = 0;
+    arena_reset(&line_arena);
+    words_reserve(t->n_words);
+    for (size_t i = 0; i < t->n_words; i++) words[i] = tmpl_expand(opts, &t->words[i]);
+    opts->n_words = t->n_words;
+    if (t->glob) glob_words(opts);
+}
+
+/**
+ * Runs a compiled line - no getline or wordsplit, and expansion only touches the slots
+ */
+static void tmpl_run(struct sh_options *opts, struct tmpl_line const *t) {
+    // like the main loop - finished jobs are reported and queued ones started between lines
+    if (opts->jobs.len > 0) wait_events(opts, 0);
+    job_queue_run(opts);
+    metrics_line(opts);
+    uint64_t phase_start = bench_now();
+    tmpl_words(opts, t);
+    bench_record(BENCH_EXPAND, phase_start);
+    if (opts->n_words > 0) parse_words_timed(opts);
+}
+
+/**
+ * Tells whether word starts (or is part of) a for/while/if block when it comes first on a line
+ */
+int block_keyword(char const *word) {
+    static char const *const keywords[] = {"for", "while", "if", "do", "done", "then", "elif", "else", "fi", "break",
+                                           "continue"};
+    for (size_t k = 0; k < sizeof keywords / sizeof *keywords; k++) {
+        if (strcmp(keywords[k], word) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Splits the next non-empty line of the block into words, with its here-documents
+ * @return - 0 at the end of input (or ^C), 1 otherwise
+ */
+static int block_read(struct sh_options *opts) {
+    while (1) {
+        if (opts->interactive == 1 && opts->input == stdin) fprintf(stderr, "> ");
+        char const *line;
+        ssize_t len = read_line(opts, &line);
+        if (len == -1) return 0;
+        arena_reset(&line_arena);
+        opts->n_words = wordsplit(line, len);
+        read_heredocs(opts);
+        if (opts->n_words > 0) return 1;
+    }
+}
+
+/**
+ * Finds where the header of a for/while/if ends - "do"/"then" may end the header line (after a ; of its own or
+ * stuck to the last word), otherwise it has to be the next line
+ * @return - 1 if the keyword was on the header line, 0 if the next line must be it
+ */
+static int block_header(struct sh_options *opts, char const *keyword, size_t *n) {
+    size_t len = opts->n_words;
+    int inline_keyword = len > 1 && strcmp(keyword, words[len - 1]) == 0;
+    if (inline_keyword) len--;
+    char *last = words[len - 1];
+    size_t last_len = strlen(last);
+    if (len > 1 && strcmp(";", last) == 0) len--;
+    else if (len > 1 && last_len > 0 && last[last_len - 1] == ';') last[last_len - 1] = '\0';
+    *n = len;
+    return inline_keyword;
+}
+
+/**
+ * Reads the line after a header that did not end with keyword
+ * @return - 0 if it is keyword alone, -1 with a message otherwise
+ */
+static int block_expect(struct sh_options *opts, char const *keyword) {
+    if (block_read(opts) && opts->n_words == 1 && strcmp(keyword, words[0]) == 0) return 0;
+    fprintf(stderr, "Syntax error: expected %s.\n", keyword);
+    return -1;
+}
+
+static struct block *block_parse(struct sh_options *opts);
+
+/**
+ * Compiles lines up to one starting with a word of ends, which is left in words
+ * @return - index of the word in ends, -1 with a message on a syntax error or the end of input
+ */
+static int block_list(struct sh_options *opts, struct block **list, char const *const ends[]) {
+    struct block **tail = list;
+    *list = NULL;
+    while (1) {
+        if (!block_read(opts)) {
+            if (opts->error == 0) fprintf(stderr, "Syntax error: input ended inside a block (wanted %s).\n", ends[0]);
+            opts->error = 0;
+            return -1;
+        }
+        for (int e = 0; ends[e] != NULL; e++) {
+            if (strcmp(ends[e], words[0]) == 0) return e;
+        }
+        struct block *b = block_parse(opts);
+        if (b == NULL) return -1;
+        *tail = b;
+        tail = &b->next;
+    }
+}
+
+/**
+ * Checks that the keyword line in words has nothing after the keyword
+ * @return - 0 if so, -1 with a message otherwise
+ */
+static int block_alone(struct sh_options *opts) {
+    if (opts->n_words == 1) return 0;
+    fprintf(stderr, "Syntax error: unexpected %s after %s.\n", words[1], words[0]);
+    return -1;
+}
+
+/**
+ * Compiles the if (or elif) block whose header is in words, up to and including its fi
+ */
+static struct block *block_if(struct sh_options *opts, struct block *b) {
+    static char const *const ends[] = {"fi", "else", "elif", NULL};
+    static char const *const fi[] = {"fi", NULL};
+    size_t n;
+    int inline_then = block_header(opts, "then", &n);
+    if (n < 2) {
+        fprintf(stderr, "Syntax error: %s needs a condition.\n", words[0]);
+        return NULL;
+    }
+    b->type = BLOCK_IF;
+    tmpl_compile(opts, &b->line, 1, n);
+    if (!inline_then && block_expect(opts, "then") == -1) return NULL;
+
+    int end = block_list(opts, &b->body, ends);
+    if (end == -1) return NULL;
+    if (end == 2) {
+        b->orelse = arena_alloc(&block_arena, sizeof *b->orelse);
+        *b->orelse = (struct block) {.type = BLOCK_IF};
+        return block_if(opts, b->orelse) ? b : NULL;
+    }
+    if (block_alone(opts) == -1) return NULL;
+    if (end == 1 && (block_list(opts, &b->orelse, fi) == -1 || block_alone(opts) == -1)) return NULL;
+    return b;
+}
+
+/**
+ * Compiles the line in words - a for/while/if header reads and compiles the rest of its block
+ * @return - the block, NULL with a message on a syntax error
+ */
+static struct block *block_parse(struct sh_options *opts) {
+    static char const *const done[] = {"done", NULL};
+    struct block *b = arena_alloc(&block_arena, sizeof *b);
+    *b = (struct block) {.type = BLOCK_LINE};
+    char const *keyword = words[0];
+    size_t n;
+
+    if (strcmp("for", keyword) == 0 || strcmp("while", keyword) == 0) {
+        int inline_do = block_header(opts, "do", &n);
+        if (keyword[0] == 'f') {
+            // for NAME in WORD...
+            if (n < 3 || var_ident(words[1]) != strlen(words[1]) || strcmp("in", words[2]) != 0) {
+                fprintf(stderr, "Syntax error: for needs NAME in WORD...\n");
+                return NULL;
+            }
+            b->type = BLOCK_FOR;
+            b->name = block_strndup(words[1], strlen(words[1]));
+            tmpl_compile(opts, &b->line, 3, n);
+        } else {
+            if (n < 2) {
+                fprintf(stderr, "Syntax error: while needs a condition.\n");
+                return NULL;
+            }
+            b->type = BLOCK_WHILE;
+            tmpl_compile(opts, &b->line, 1, n);
+        }
+        if (!inline_do && block_expect(opts, "do") == -1) return NULL;
+        if (block_list(opts, &b->body, done) == -1 || block_alone(opts) == -1) return NULL;
+    } else if (strcmp("if", keyword) == 0) {
+        return block_if(opts, b);
+    } else if (strcmp("break", keyword) == 0 || strcmp("continue", keyword) == 0) {
+        b->type = keyword[0] == 'b' ? BLOCK_BREAK : BLOCK_CONTINUE;
+        b->levels = opts->n_words > 1 ? (int) strtol(words[1], NULL, 10) : 1;
+        if (b->levels < 1 || opts->n_words > 2) {
+            fprintf(stderr, "Syntax error: %s takes a loop count of 1 or more.\n", keyword);
+            return NULL;
+        }
+    } else if (block_keyword(keyword)) {
+        fprintf(stderr, "Syntax error: unexpected %s.\n", keyword);
+        return NULL;
+    } else {
+        tmpl_compile(opts, &b->line, 0, opts->n_words);
+    }
+    return b;
+}
+
+/* how a list of a block ended - break/continue N leave flow_levels - 1 more loops; FLOW_END ends the loop at hand,
+ * FLOW_EXIT every loop once exit ran */
+enum { FLOW_NEXT, FLOW_BREAK, FLOW_CONTINUE, FLOW_INTERRUPT, FLOW_END, FLOW_EXIT };
+static int flow_levels;
+
+/**
+ * Checks for ^C between iterations in interactive mode - a command killed by SIGINT or one typed while only
+ * in-process commands ran (finished background jobs are reported on the way)
+ */
+static int block_interrupted(struct sh_options *opts) {
+    if (opts->interactive != 1) return 0;
+    return opts->exit_status == 128 + SIGINT || (wait_events(opts, 0) & EVENT_INTERRUPT);
+}
+
+static int block_exec(struct sh_options *opts, struct block const *b);
+
+/**
+ * Runs the body of a loop once
+ * @return - FLOW_NEXT to go on with the loop, FLOW_END to end it, anything else to hand to the enclosing loop
+ */
+static int loop_body(struct sh_options *opts, struct block const *b) {
+    int flow = block_exec(opts, b->body);
+    if (flow == FLOW_INTERRUPT || flow == FLOW_EXIT) return flow;
+    // break/continue N - the loop N levels out takes it
+    if (flow != FLOW_NEXT && --flow_levels > 0) return flow;
+    if (flow == FLOW_BREAK) return FLOW_END;
+    return FLOW_NEXT;
+}
+
+/**
+ * Runs a for loop - the words are expanded once and split at blanks, then NAME takes each value in turn
+ */
+static int block_for(struct sh_options *opts, struct block const *b) {
+    tmpl_words(opts, &b->line);
+    // the values outlive line_arena, which every body line resets
+    size_t size = 0;
+    for (size_t i = 0; i < opts->n_words; i++) size += strlen(words[i]) + 1;
+    char **values = malloc(sizeof *values * (size / 2 + 1) + size);
+    if (!values) err(1, "malloc");
+    char *text = (char *) (values + size / 2 + 1);
+    size_t n_values = 0;
+    for (size_t i = 0; i < opts->n_words; i++) {
+        for (char *v = strtok(strcpy(text, words[i]), " \t\n"); v; v = strtok(NULL, " \t\n")) values[n_values++] = v;
+        text += strlen(words[i]) + 1;
+    }
+
+    int flow = FLOW_NEXT, status = 0;
+    for (size_t v = 0; v < n_values && flow == FLOW_NEXT; v++) {
+        if (block_interrupted(opts)) {
+            flow = FLOW_INTERRUPT;
+            break;
+        }
+        build_str(NULL, NULL);
+        build_str(b->name, NULL);
+        build_str("=", NULL);
+        var_set(&opts->vars, build_str(values[v], NULL), 0);
+        flow = loop_body(opts, b);
+        status = opts->exit_status;
+    }
+    free(values);
+    opts->exit_status = status;
+    return flow == FLOW_END ? FLOW_NEXT : flow;
+}
+
+/**
+ * Runs a while loop - its status is that of the last body command run, 0 if none was
+ */
+static int block_while(struct sh_options *opts, struct block const *b) {
+    int flow = FLOW_NEXT, status = 0;
+    while (flow == FLOW_NEXT) {
+        if (block_interrupted(opts)) return FLOW_INTERRUPT;
+        tmpl_run(opts, &b->line);
+        if (opts->exit_status != 0) break;
+        flow = loop_body(opts, b);
+        status = opts->exit_status;
+    }
+    opts->exit_status = status;
+    return flow == FLOW_END ? FLOW_NEXT : flow;
+}
+
+/**
+ * Runs a compiled list
+ * @return - FLOW_NEXT when it ran to the end, else what stopped it
+ */
+static int block_exec(struct sh_options *opts, struct block const *b) {
+    for (; b != NULL; b = b->next) {
+        int flow = FLOW_NEXT;
+        switch (b->type) {
+            case BLOCK_LINE:
+                tmpl_run(opts, &b->line);
+                break;
+            case BLOCK_BREAK:
+            case BLOCK_CONTINUE:
+                flow_levels = b->levels;
+                return b->type == BLOCK_BREAK ? FLOW_BREAK : FLOW_CONTINUE;
+            case BLOCK_IF:
+                tmpl_run(opts, &b->line);
+                if (opts->exit_status == 0) flow = block_exec(opts, b->body);
+                else if (b->orelse != NULL) flow = block_exec(opts, b->orelse);
+                else opts->exit_status = 0;
+                break;
+            case BLOCK_WHILE:
+                flow = block_while(opts, b);
+                break;
+            case BLOCK_FOR:
+                flow = block_for(opts, b);
+                break;
+        }
+        if (opts->exiting) return FLOW_EXIT;
+        if (flow != FLOW_NEXT) return flow;
+    }
+    return FLOW_NEXT;
+}
+
+/**
+ * Reads the rest of the block whose first line is in words, compiles it and runs it - a syntax error drops the
+ * block with status 2, and break or continue outside a loop does nothing
+ */
+void run_block(struct sh_options *opts) {
+    struct block const *b = block_parse(opts);
+    if (b == NULL) {
+        opts->exit_status = 2;
+    } else {
+        // ^C is read from the signalfd between iterations
+        if (opts->interactive == 1) sigaction(SIGINT, &opts->sigint_action, NULL);
+        if (block_exec(opts, b) == FLOW_INTERRUPT) fprintf(stderr, "\n");
+        if (opts->interactive == 1) sigaction(SIGINT, &opts->sig_ignore, NULL);
+    }
+    arena_reset(&block_arena);
+}
+
+/**
+ * Adds the members of the [:name:] character class whose name starts at s to set
+ * @return - length of the name, 0 if s does not start a known class
+ */
+static size_t glob_class(uint8_t set[32], char const *s, size_t len) {
+    static struct {
+        char const *name;
+        int (*is)(int);
+    } const classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl}, {"digit", isdigit},
+        {"graph", isgraph}, {"lower", islower}, {"print", isprint}, {"punct", ispunct}, {"space", isspace},
+        {"upper", isupper}, {"xdigit", isxdigit},
+    };
+    char const *end = memmem(s, len, ":]", 2);
+    if (end == NULL) return 0;
+    for (size_t k = 0; k < sizeof classes / sizeof classes[0]; k++) {
+        if (strlen(classes[k].name) != (size_t) (end - s) || memcmp(classes[k].name, s, end - s) != 0) continue;
+        for (int b = 0; b < 256; b++) {
+            if (classes[k].is(b)) set[b >> 3] |= 1 << (b & 7);
+        }
+        return end - s;
+    }
+    return 0;
+}
+
+/**
+ * Compiles one path component of a pattern - every token matches one byte except GLOB_STAR. The literal prefix and
+ * suffix around the stars let most names be rejected with two memcmps.
+ * @return - 1 if the component has a *, ? or [...] (and needs a directory listing), 0 if it is a plain name
+ */
+static int glob_compile(struct glob_pattern *p, char const *comp, size_t len) {
+    struct glob_token *tok = arena_alloc(&line_arena, sizeof *tok * (len + 1));
+    size_t n = 0;
+    int wild = 0;
+    for (size_t c = 0; c < len; c++) {
+        struct glob_token *t = &tok[n++];
+        *t = (struct glob_token) {.type = GLOB_BYTE, .byte = (unsigned char) comp[c]};
+        if (comp[c] == '*') {
+            // runs of stars are one star
+            if (n > 1 && tok[n - 2].type == GLOB_STAR) n--;
+            else t->type = GLOB_STAR;
+            wild = 1;
+        } else if (comp[c] == '?') {
+            t->type = GLOB_ANY;
+            wild = 1;
+        } else if (comp[c] == '[') {
+            // bracket expression - [abc], [a-z], [!x] or [^x], [[:class:]]; ']' first is a member; unterminated
+            // brackets are literal
+            size_t e = c + 1;
+            int negate = e < len && (comp[e] == '!' || comp[e] == '^');
+            if (negate) e++;
+            uint8_t set[32] = {0};
+            for (size_t first = e; e < len && (comp[e] != ']' || e == first); ) {
+                size_t class_end;
+                if (comp[e] == '[' && e + 1 < len && comp[e + 1] == ':' &&
+                    (class_end = glob_class(set, comp + e + 2, len - e - 2)) > 0) {
+                    e += class_end + 4;
+                } else if (e + 2 < len && comp[e + 1] == '-' && comp[e + 2] != ']') {
+                    for (int b = (unsigned char) comp[e]; b <= (unsigned char) comp[e + 2]; b++) {
+                        set[b >> 3] |= 1 << (b & 7);
                     }
+                    e += 3;
+                } else {
+                    set[(unsigned char) comp[e] >> 3] |= 1 << (comp[e] & 7);
+                    e++;
                 }
             }
+            if (e >= len) continue;
+            if (negate) for (int b = 0; b < 32; b++) set[b] = ~set[b];
+            memcpy(t->set, set, sizeof set);
+            t->type = GLOB_SET;
+            wild = 1;
+            c = e;
+        }
+    }
+    *p = (struct glob_pattern) {.tok = tok, .len = n};
+    while (p->prefix_len < n && tok[p->prefix_len].type == GLOB_BYTE) p->prefix_len++;
+    while (p->suffix_len < n - p->prefix_len && tok[n - 1 - p->suffix_len].type == GLOB_BYTE) p->suffix_len++;
+    for (size_t t = 0; t < n; t++) p->min_len += tok[t].type != GLOB_STAR;
+    p->has_star = p->min_len != n;
+    p->dot = n > 0 && tok[0].type == GLOB_BYTE && tok[0].byte == '.';
+    return wild;
+}
 
-            // execute command in the child process
-            if (execvp(exec_arr[0], exec_arr) == -1) {
-                //fprintf(stderr, "Error executing command %s in child process\n", exec_arr[0]);
-                exit(1);
-            }
+/**
+ * Matches a name against a compiled component - after the prefix/suffix checks, the usual linear scan that only
+ * returns to the last star (no recursion)
+ */
+static bool glob_match(struct glob_pattern const *p, char const *name, size_t n) {
+    if (n < p->min_len || (!p->has_star && n != p->min_len)) return false;
+    if (name[0] == '.' && !p->dot) return false;
+    for (size_t t = 0; t < p->prefix_len; t++) {
+        if ((unsigned char) name[t] != p->tok[t].byte) return false;
+    }
+    for (size_t t = 0; t < p->suffix_len; t++) {
+        if ((unsigned char) name[n - 1 - t] != p->tok[p->len - 1 - t].byte) return false;
+    }
+
+    size_t t = 0, i = 0, star_t = SIZE_MAX, star_i = 0;
+    while (i < n) {
+        struct glob_token const *tok = t < p->len ? &p->tok[t] : NULL;
+        if (tok && tok->type == GLOB_STAR) {
+            star_t = ++t;
+            star_i = i;
+            continue;
+        }
+        unsigned char b = (unsigned char) name[i];
+        if (tok && (tok->type == GLOB_ANY || (tok->type == GLOB_BYTE && tok->byte == b) ||
+                    (tok->type == GLOB_SET && (tok->set[b >> 3] >> (b & 7) & 1)))) {
+            t++;
+            i++;
+            continue;
+        }
+        if (star_t == SIZE_MAX) return false;
+        t = star_t;
+        i = ++star_i;
+    }
+    while (t < p->len && p->tok[t].type == GLOB_STAR) t++;
+    return t == p->len;
+}
+
+/**
+ * The directory listing for path ("" is the working directory) - read with getdents64 the first time this line asks
+ * for it, then served from the per-line cache (an open addressing map sized to the line's patterns)
+ * @return - the cached listing, with no chunks if the directory could not be read
+ */
+static struct glob_dir *glob_dir(struct glob_cache *cache, char const *path) {
+    size_t mask = cache->n_slots - 1;
+    size_t h = path_hash(path) & mask;
+    while (cache->dirs[h] != NULL && strcmp(cache->dirs[h]->path, path) != 0) h = (h + 1) & mask;
+    if (cache->dirs[h] != NULL) return cache->dirs[h];
+    if (2 * (cache->len + 1) > cache->n_slots) {
+        // grow and rehash at 50% load
+        struct glob_cache old = *cache;
+        cache->n_slots *= 2;
+        cache->dirs = arena_alloc(&line_arena, sizeof *cache->dirs * cache->n_slots);
+        memset(cache->dirs, 0, sizeof *cache->dirs * cache->n_slots);
+        for (size_t s = 0; s < old.n_slots; s++) {
+            if (old.dirs[s] == NULL) continue;
+            size_t d = path_hash(old.dirs[s]->path) & (cache->n_slots - 1);
+            while (cache->dirs[d] != NULL) d = (d + 1) & (cache->n_slots - 1);
+            cache->dirs[d] = old.dirs[s];
+        }
+        return glob_dir(cache, path);
+    }
 
-            // close redirection file descriptors
-            if (read_fd != -5) close(read_fd);
-            if (write_fd != -5) close(write_fd);
-            if (append_fd != -5) close(append_fd);
+    struct glob_dir *dir = arena_alloc(&line_arena, sizeof *dir);
+    *dir = (struct glob_dir) {.path = arena_strdup(&line_arena, path)};
+    cache->dirs[h] = dir;
+    cache->len++;
+
+    int fd = open(path[0] ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return dir;
+    // the records stay in the buffers getdents64 filled - chunks double up to 1 MiB, so a million entries take a
+    // few dozen calls and nothing is copied per name
+    struct glob_chunk **tail = &dir->chunks;
+    for (size_t size = 32768; ; size = size < ((size_t) 1 << 20) ? size * 2 : size) {
+        struct glob_chunk *chunk = malloc(sizeof *chunk + size);
+        if (!chunk) err(1, "malloc");
+        ssize_t got = getdents64(fd, chunk->data, size);
+        if (got <= 0) {
+            free(chunk);
             break;
+        }
+        chunk->next = NULL;
+        chunk->len = (size_t) got;
+        *tail = chunk;
+        tail = &chunk->next;
+    }
+    close(fd);
+    return dir;
+}
 
-        // PARENT PROCESS
-        default:
-            // FOREGROUND PROCESSES
-            if (background == 0) {
-                // perform non-blocking wait and set exit value after exit
-                opts->process_pid = waitpid(child_pid, &opts->child_status, WUNTRACED);
+/**
+ * Joins a directory prefix and a name into line_arena - "" is the working directory
+ */
+static char *glob_join(char const *dir, char const *name, size_t name_len) {
+    size_t dir_len = strlen(dir);
+    int sep = dir_len > 0 && dir[dir_len - 1] != '/';
+    char *path = arena_alloc(&line_arena, dir_len + sep + name_len + 1);
+    memcpy(path, dir, dir_len);
+    if (sep) path[dir_len] = '/';
+    memcpy(path + dir_len + sep, name, name_len);
+    path[dir_len + sep + name_len] = '\0';
+    return path;
+}
 
-                if (WIFEXITED(opts->child_status)) {
-                    opts->exit_status = WEXITSTATUS(opts->child_status);
-                }
-                // if signaled - set exit value to n + 128
-                if WIFSIGNALED(opts->child_status) {
-                    opts->exit_status = WTERMSIG(opts->child_status) + 128;
-                }
-                // if process has stopped - restart and run in the background
-                if WIFSTOPPED(opts->child_status) {
-                    kill(child_pid, SIGCONT);
-                    fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) child_pid);
-                    opts->background_pid = opts->process_pid;
-                    opts->background_pids[opts->background_count] = child_pid;
-                    opts->background_count++;
+/**
+ * Adds a path to a growable list in line_arena
+ */
+static void glob_push(struct glob_list *list, char *path) {
+    if (list->len == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 16;
+        char **paths = arena_alloc(&line_arena, sizeof *paths * cap);
+        if (list->len) memcpy(paths, list->paths, sizeof *paths * list->len);
+        list->paths = paths;
+        list->cap = cap;
+    }
+    list->paths[list->len++] = path;
+}
+
+/**
+ * Compares two paths for qsort - byte order, as in the C locale
+ */
+static int glob_cmp(void const *a, void const *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * Expands one pattern component by component - plain components are appended as they are, wildcard ones list each
+ * directory reached so far (every directory once per line) and keep the names that match. Components before the last
+ * keep directories only.
+ * @return - sorted matches, an empty list if nothing matched
+ */
+static struct glob_list glob_expand(struct glob_cache *cache, char const *pattern) {
+    struct glob_list found = {0};
+    glob_push(&found, pattern[0] == '/' ? "/" : "");
+    int checked = 1;    // every path in found is known to exist
+
+    for (char const *comp = pattern; *comp; ) {
+        while (*comp == '/') comp++;
+        if (*comp == '\0') break;
+        size_t len = strcspn(comp, "/");
+        int last = comp[len] == '\0' || comp[len + strspn(comp + len, "/")] == '\0';
+        int want_dir = !last || comp[len] == '/';
+        struct glob_pattern p;
+        struct glob_list next = {0};
+
+        if (!glob_compile(&p, comp, len)) {
+            for (size_t f = 0; f < found.len; f++) glob_push(&next, glob_join(found.paths[f], comp, len));
+            checked = 0;
+        } else {
+            for (size_t f = 0; f < found.len; f++) {
+                struct glob_dir *dir = glob_dir(cache, found.paths[f]);
+                for (struct glob_chunk *chunk = dir->chunks; chunk; chunk = chunk->next) {
+                    for (size_t off = 0; off < chunk->len; ) {
+                        struct dirent64 *d = (struct dirent64 *) (chunk->data + off);
+                        off += d->d_reclen;
+                        size_t n = strlen(d->d_name);
+                        if ((n == 1 && d->d_name[0] == '.') || (n == 2 && d->d_name[0] == '.' && d->d_name[1] == '.')) {
+                            continue;
+                        }
+                        if (!glob_match(&p, d->d_name, n)) continue;
+                        char *path = glob_join(found.paths[f], d->d_name, n);
+                        if (want_dir && d->d_type != DT_DIR) {
+                            struct stat st;
+                            if (d->d_type != DT_LNK && d->d_type != DT_UNKNOWN) continue;
+                            if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) continue;
+                        }
+                        glob_push(&next, path);
+                    }
                 }
             }
-            // BACKGROUND PROCESSES
-            else {
-                opts->background_pid = child_pid;
-                opts->background_pids[opts->background_count] = child_pid;
-                opts->background_count++;
-            }
+            checked = 1;
+        }
+        found = next;
+        comp += len;
+        if (found.len == 0) break;
     }
-    fflush(stdout);
 
-    return 0;
+    // plain components after the last wildcard one still have to exist
+    if (!checked) {
+        size_t kept = 0;
+        struct stat st;
+        for (size_t f = 0; f < found.len; f++) {
+            if (lstat(found.paths[f], &st) == 0) found.paths[kept++] = found.paths[f];
+        }
+        found.len = kept;
+    }
+    // a trailing slash stays on every match
+    size_t pattern_len = strlen(pattern);
+    if (pattern_len > 0 && pattern[pattern_len - 1] == '/') {
+        for (size_t f = 0; f < found.len; f++) found.paths[f] = glob_join(found.paths[f], "", 0);
+    }
+    qsort(found.paths, found.len, sizeof *found.paths, glob_cmp);
+    return found;
 }
 
 /**
- * Splits command line entries into words - code from the professor
+ * Pathname expansion - every argument with a *, ? or [ is replaced by the sorted paths it matches, or kept as it is
+ * when nothing matches. Leading NAME=value words, redirection targets and here-document bodies are left alone. The
+ * directories read are shared by all patterns of the line and released with it.
  */
-size_t wordsplit(char const *line) {
-    size_t wlen = 0;
-    size_t wind = 0;
+void glob_words(struct sh_options *opts) {
+    size_t n = opts->n_words, first = 0;
+    while (first < n && strpbrk(words[first], "*?[") == NULL) first++;
+    if (first == n) return;
 
-    char const *c = line;
-    for (;*c && isspace(*c); ++c); /* discard leading space */
+    // the words are rewritten in place, so the loop reads a copy
+    char **in = arena_alloc(&line_arena, sizeof *in * n);
+    memcpy(in, words, sizeof *in * n);
+    struct glob_cache cache = {.n_slots = 16};
+    cache.dirs = arena_alloc(&line_arena, sizeof *cache.dirs * cache.n_slots);
+    memset(cache.dirs, 0, sizeof *cache.dirs * cache.n_slots);
+    size_t out = 0;
+    int prefix = 1;
 
-    for (; *c;) {
-        if (wind == 512) break;
-        /* read a word */
-        if (*c == '#') break;
-        for (;*c && !isspace(*c); ++c) {
-            if (*c == '\\') ++c;
-            void *tmp = realloc(words[wind], sizeof **words * (wlen + 2));
+    for (size_t i = 0; i < n; i++) {
+        char *word = in[i];
+        char const *prev = i > 0 ? in[i - 1] : "";
+        prefix = prefix && var_name_len(word) > 0;
+        struct redir op[2];
+        int n_ops;
+        size_t op_len = redir_parse(prev, op, &n_ops);
+        int target = prev == heredoc_word || prev == heredoc_raw_word || (op_len > 0 && prev[op_len] == '\0') ||
+                     strcmp("<<<", prev) == 0;
+        int literal = prefix || target || strncmp("<<", word, 2) == 0 || redir_parse(word, op, &n_ops) > 0 ||
+                      strpbrk(word, "*?[") == NULL;
+        struct glob_list found = {0};
+        if (!literal) found = glob_expand(&cache, word);
+        if (found.len == 0) {
+            words_reserve(out + 1);
+            words[out++] = word;
+            continue;
+        }
+        words_reserve(out + found.len);
+        memcpy(&words[out], found.paths, sizeof *found.paths * found.len);
+        out += found.len;
+    }
+    opts->n_words = out;
+
+    for (size_t s = 0; s < cache.n_slots; s++) {
+        if (cache.dirs[s] == NULL) continue;
+        for (struct glob_chunk *chunk = cache.dirs[s]->chunks, *next; chunk; chunk = next) {
+            next = chunk->next;
+            free(chunk);
+        }
+    }
+}
+
+/**
+ * Text of a history entry, inside the mapped ring - only while its record is still kept (seq >= first_seq)
+ */
+static char const *history_text(struct history const *h, struct history_entry const *e) {
+    return h->ring + e->off % h->hdr->ring + sizeof(uint32_t);
+}
+
+/**
+ * Bytes of a ring record holding a line of len bytes
+ */
+static uint64_t history_record(uint64_t len) {
+    return (len + sizeof(uint32_t) + 7) & ~(uint64_t) 7;
+}
+
+/**
+ * Drops the trigram index - rebuilt by history_index on the next search
+ */
+static void history_unindex(struct history *h) {
+    for (size_t s = 0; s < h->n_slots; s++) free(h->grams[s].ids);
+    free(h->grams);
+    h->grams = NULL;
+    h->n_grams = h->n_slots = h->indexed = 0;
+}
+
+/**
+ * Reads the records other shells (or this one) appended since the last call into entries, dropping the entries the
+ * ring has overwritten once they are half of them - the caller holds the file lock
+ */
+static void history_sync(struct history *h) {
+    struct history_header const *hdr = h->hdr;
+    // fell behind the ring - every entry read so far is gone
+    if (h->seen_seq < hdr->first_seq) {
+        h->seen = hdr->head;
+        h->seen_seq = hdr->first_seq;
+        h->len = 0;
+        history_unindex(h);
+    }
+    while (h->seen < hdr->tail) {
+        uint64_t pos = h->seen % hdr->ring;
+        uint32_t len;
+        memcpy(&len, h->ring + pos, sizeof len);
+        if (len == HISTORY_WRAP) {
+            h->seen += hdr->ring - pos;
+            continue;
+        }
+        if (h->len == h->cap) {
+            h->cap = h->cap ? h->cap * 2 : 1024;
+            void *tmp = realloc(h->entries, sizeof *h->entries * h->cap);
             if (!tmp) err(1, "realloc");
-            words[wind] = tmp;
-            words[wind][wlen++] = *c;
-            words[wind][wlen] = '\0';
+            h->entries = tmp;
         }
-        ++wind;
-        wlen = 0;
-        for (;*c && isspace(*c); ++c);
+        h->entries[h->len++] = (struct history_entry) {.seq = h->seen_seq++, .off = h->seen, .len = len};
+        h->seen += history_record(len);
+    }
+
+    // entries are numbered without gaps, so the overwritten ones are a prefix
+    size_t evicted = h->len && h->entries[0].seq < hdr->first_seq ? hdr->first_seq - h->entries[0].seq : 0;
+    if (evicted > h->len) evicted = h->len;
+    if (evicted > 0 && evicted * 2 >= h->len) {
+        memmove(h->entries, h->entries + evicted, sizeof *h->entries * (h->len - evicted));
+        h->len -= evicted;
+        history_unindex(h);
     }
-    return wind;
 }
 
 /**
- * Detects certain symbols in a word and records their start/end pointers - code from the professor
+ * Posting list of a trigram (three bytes of a line) - add claims a free slot for a new one, otherwise it is NULL
  */
-char param_scan(char const *word, char const **start, char const **end) {
-    static char const *prev;
-    if (!word) word = prev;
+static struct history_gram *history_gram(struct history *h, uint32_t gram, int add) {
+    // grow at 50% load
+    if (add && (h->n_grams + 1) * 2 > h->n_slots) {
+        struct history_gram *old = h->grams;
+        size_t n_old = h->n_slots;
+        h->n_slots = n_old ? n_old * 2 : 4096;
+        h->grams = calloc(h->n_slots, sizeof *h->grams);
+        if (!h->grams) err(1, "calloc");
+        for (size_t s = 0; s < n_old; s++) {
+            if (old[s].cap == 0) continue;
+            size_t slot = (old[s].gram * 2654435761u) & (h->n_slots - 1);
+            while (h->grams[slot].cap != 0) slot = (slot + 1) & (h->n_slots - 1);
+            h->grams[slot] = old[s];
+        }
+        free(old);
+    }
+    if (h->n_slots == 0) return NULL;
+    for (size_t slot = (gram * 2654435761u) & (h->n_slots - 1); ; slot = (slot + 1) & (h->n_slots - 1)) {
+        struct history_gram *g = &h->grams[slot];
+        if (g->cap != 0 && g->gram == gram) return g;
+        if (g->cap == 0) {
+            if (!add) return NULL;
+            h->n_grams++;
+            *g = (struct history_gram) {.gram = gram, .cap = 4};
+            g->ids = malloc(sizeof *g->ids * g->cap);
+            if (!g->ids) err(1, "malloc");
+            return g;
+        }
+    }
+}
 
-    char ret = 0;
-    *start = 0;
-    *end = 0;
-    for (char const *s = word; *s && !ret; ++s) {
-        s = strchr(s, '$');
-        if (!s) break;
-        switch (s[1]) {
-            case '$':
-            case '!':
-            case '?':
-                ret = s[1];
-                *start = s;
-                *end = s + 2;
-                break;
-            case '{':;
-                char *e = strchr(s + 2, '}');
-                if (e) {
-                    ret = s[1];
-                    *start = s;
-                    *end = e + 1;
-                }
-                break;
+/**
+ * Adds the entries up to entries[end] to the trigram index - each entry once per trigram it holds, so every posting
+ * list stays in entry order. Built while the prompt waits for input or by a search, never at startup.
+ */
+static void history_index(struct history *h, size_t end) {
+    for (; h->indexed < end; h->indexed++) {
+        struct history_entry const *e = &h->entries[h->indexed];
+        if (e->seq < h->hdr->first_seq) continue;
+        unsigned char const *s = (unsigned char const *) history_text(h, e);
+        for (uint32_t i = 0; i + 3 <= e->len; i++) {
+            struct history_gram *g = history_gram(h, (uint32_t) s[i] << 16 | s[i + 1] << 8 | s[i + 2], 1);
+            if (g->len > 0 && g->ids[g->len - 1] == h->indexed) continue;
+            if (g->len == g->cap) {
+                g->cap *= 2;
+                void *tmp = realloc(g->ids, sizeof *g->ids * g->cap);
+                if (!tmp) err(1, "realloc");
+                g->ids = tmp;
+            }
+            g->ids[g->len++] = (uint32_t) h->indexed;
         }
     }
-    prev = *end;
-    return ret;
 }
 
 /**
- * String builder method for building up memory allocated strings - code from professor
+ * Finds the newest kept entry before entries[before] that contains text (or starts with it) - the candidates are
+ * the posting list of text's rarest trigram, or every entry for text under three bytes. The caller holds the lock.
+ * @return - index in entries, -1 for none
  */
-char *build_str(char const *start, char const *end) {
-    static size_t base_len = 0;
-    static char *base = 0;
+static ssize_t history_search(struct history *h, char const *text, size_t len, int prefix, size_t before) {
+    history_index(h, h->len);
+    struct history_gram const *best = NULL;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        unsigned char const *s = (unsigned char const *) text + i;
+        struct history_gram const *g = history_gram(h, (uint32_t) s[0] << 16 | s[1] << 8 | s[2], 0);
+        if (g == NULL) return -1;
+        if (best == NULL || g->len < best->len) best = g;
+    }
 
-    if (!start) {
-        /* Reset; new base string, return old one */
-        char *ret = base;
-        base = NULL;
-        base_len = 0;
-        return ret;
+    // candidates newest first, from the last one before before
+    size_t n = before;
+    if (best != NULL) {
+        size_t lo = 0, hi = best->len;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (best->ids[mid] < before) lo = mid + 1;
+            else hi = mid;
+        }
+        n = lo;
     }
-    /* Append [start, end) to base string
-     * If end is NULL, append whole start string to base string.
-     * Returns a newly allocated string that the caller must free.
-     */
-    size_t n = end ? end - start : strlen(start);
-    size_t newsize = sizeof *base *(base_len + n + 1);
-    void *tmp = realloc(base, newsize);
-    if (!tmp) err(1, "realloc");
-    base = tmp;
-    memcpy(base + base_len, start, n);
-    base_len += n;
-    base[base_len] = '\0';
+    while (n-- > 0) {
+        size_t id = best != NULL ? best->ids[n] : n;
+        struct history_entry const *e = &h->entries[id];
+        if (e->seq < h->hdr->first_seq || e->len < len) continue;
+        char const *s = history_text(h, e);
+        if (prefix ? memcmp(s, text, len) == 0 : memmem(s, e->len, text, len) != NULL) return (ssize_t) id;
+    }
+    return -1;
+}
 
-    return base;
+/**
+ * Indexes the next HISTORY_IDLE_SLICE entries while the shell waits for input
+ * @return - 1 if entries are left to index
+ */
+int history_idle(struct history *h) {
+    if (h->fd == -1 || h->indexed >= h->len) return 0;
+    flock(h->fd, LOCK_SH);
+    history_index(h, h->len - h->indexed > HISTORY_IDLE_SLICE ? h->indexed + HISTORY_IDLE_SLICE : h->len);
+    flock(h->fd, LOCK_UN);
+    return h->indexed < h->len;
 }
 
 /**
- * Method for replacing certain symbols with data -- template code from the professor
+ * Entry numbered seq, NULL if the ring no longer holds it - the caller holds the lock
  */
-char *expand(char const *word, struct sh_options *opts) {
-    char const *pos = word;
-    char const *start, *end;
-    char c = param_scan(pos, &start, &end);
-    build_str(NULL, NULL);
-    build_str(pos, start);
+static struct history_entry const *history_entry(struct history *h, uint64_t seq) {
+    if (h->len == 0 || seq < h->hdr->first_seq || seq < h->entries[0].seq || seq - h->entries[0].seq >= h->len) {
+        return NULL;
+    }
+    return &h->entries[seq - h->entries[0].seq];
+}
 
-    while (c) {
-        // $! symbol - replace with pid of most recent background process OR "" if none
-        if (c == '!') {
-            if (opts->background_pid == 0) {
-                build_str("", NULL);
-            } else {
-                char bkg_pid_str[12] = {0};
-                sprintf(bkg_pid_str, "%d", opts->background_pid);
-                build_str(bkg_pid_str, NULL);
-                }
-            }
-        // $$ symbol - replace with pid of smallsh parent process
-        else if (c == '$') {
-            char pid_str[12] = {0};
-            sprintf(pid_str, "%d", opts->parent_pid);
-            build_str(pid_str, NULL);
-        // $? symbol - replace with the exit status of last foreground process OR "0" if none
-        } else if (c == '?') {
-            char status_str[12] = {0};
-            sprintf(status_str, "%d", opts->exit_status);
-            build_str(status_str, NULL);
-        // ${PARAM} - replace PARAM with the environment variable of the process or "" if not valid
-        } else if (c == '{') {
-            char envvar[MAX_WORDS] = {0};
-            int env_len = end - start - 3;
-            strncpy(envvar, start + 2, env_len);
-            char* getvar = getenv(envvar);
-            if (getvar == NULL) {
-                build_str("", NULL);
-            } else {
-                build_str(getvar, NULL);
-            }
+/**
+ * Maps the history file at path, setting it up when it is new - every shell with it open shares the ring
+ * @return - 0 on success, -1 after a warning (the shell then keeps no history)
+ */
+int history_open(struct history *h, char const *path) {
+    size_t size = HISTORY_HEADER + HISTORY_RING;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        warn("%s", path);
+        return -1;
+    }
+
+    // a new file is sized (sparse) and given its header under the lock, so a second shell never sees it half made
+    flock(fd, LOCK_EX);
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (st.st_size == 0 ? ftruncate(fd, (off_t) size) == 0 : (size_t) st.st_size == size)) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    struct history_header *hdr = map;
+    if (map != MAP_FAILED && st.st_size == 0) {
+        *hdr = (struct history_header) {.magic = HISTORY_MAGIC, .ring = HISTORY_RING, .first_seq = 1, .next_seq = 1};
+    }
+    if (map == MAP_FAILED || hdr->magic != HISTORY_MAGIC || hdr->ring != HISTORY_RING) {
+        warnx("%s: not a smallsh history file, history is off", path);
+        if (map != MAP_FAILED) munmap(map, size);
+        close(fd);
+        return -1;
+    }
+    *h = (struct history) {.fd = fd, .hdr = hdr, .ring = (char *) map + HISTORY_HEADER};
+    history_sync(h);
+    flock(fd, LOCK_UN);
+    return 0;
+}
+
+/**
+ * Unmaps the history file and frees the entries and the index
+ */
+void history_close(struct history *h) {
+    if (h->fd == -1) return;
+    munmap(h->hdr, HISTORY_HEADER + HISTORY_RING);
+    close(h->fd);
+    history_unindex(h);
+    free(h->entries);
+    free(h->line);
+    *h = (struct history) {.fd = -1};
+}
+
+/**
+ * Appends a line (without its newline) to the ring, overwriting the oldest records as needed - blank lines, lines
+ * over HISTORY_LINE_MAX and a repeat of the newest line are not kept
+ */
+void history_add(struct history *h, char const *line, size_t len) {
+    if (len > 0 && line[len - 1] == '\n') len--;
+    size_t blank = 0;
+    while (blank < len && isblank((unsigned char) line[blank])) blank++;
+    if (h->fd == -1 || blank == len || len > HISTORY_LINE_MAX) return;
+
+    flock(h->fd, LOCK_EX);
+    history_sync(h);
+    struct history_header *hdr = h->hdr;
+    struct history_entry const *last = h->len > 0 ? &h->entries[h->len - 1] : NULL;
+    if (last && last->seq >= hdr->first_seq && last->len == len && memcmp(history_text(h, last), line, len) == 0) {
+        h->last_seq = last->seq;
+        flock(h->fd, LOCK_UN);
+        return;
+    }
+
+    // a record never straddles the end of the ring - a filler takes the rest of it
+    uint64_t need = history_record(len);
+    uint64_t pos = hdr->tail % hdr->ring;
+    uint64_t fill = pos + need > hdr->ring ? hdr->ring - pos : 0;
+    while (hdr->tail + fill + need - hdr->head > hdr->ring) {
+        uint32_t old;
+        memcpy(&old, h->ring + hdr->head % hdr->ring, sizeof old);
+        if (old == HISTORY_WRAP) {
+            hdr->head += hdr->ring - hdr->head % hdr->ring;
+        } else {
+            hdr->head += history_record(old);
+            hdr->first_seq++;
         }
-        pos = end;
-        c = param_scan(pos, &start, &end);
-        build_str(pos, start);
     }
-    return build_str(start, NULL);
+    if (fill > 0) {
+        uint32_t wrap = HISTORY_WRAP;
+        memcpy(h->ring + pos, &wrap, sizeof wrap);
+        hdr->tail += fill;
+        pos = 0;
+    }
+    uint32_t len32 = (uint32_t) len;
+    memcpy(h->ring + pos, &len32, sizeof len32);
+    memcpy(h->ring + pos + sizeof len32, line, len);
+    // published last - a shell reading under the lock only goes up to tail
+    hdr->tail += need;
+    h->last_seq = hdr->next_seq++;
+    history_sync(h);
+    flock(h->fd, LOCK_UN);
+}
+
+/**
+ * Replaces the history events of a line before it is split - !! (this shell's last line), !N (line N), !?TEXT (the
+ * newest line containing TEXT) and !PREFIX (the newest line starting with PREFIX), each a word or the start of one.
+ * As in bash, a ! inside single quotes or after a backslash is left alone, and an event that matches nothing is kept
+ * as it was typed. A line with events is printed as it will run.
+ * @return - the line (len updated)
+ */
+char const *history_expand(struct sh_options *opts, char const *line, size_t *len) {
+    struct history *h = &opts->history;
+    size_t n = *len, out = 0;
+    int events = 0;
+    char const *copied = line;  // start of the text not yet copied
+    int quoted = 0;             // inside '' or ""
+
+    for (size_t i = 0; i + 1 < n; i++) {
+        char next = line[i + 1];
+        if (line[i] == '\\' && quoted != '\'') {
+            i++;
+            continue;
+        }
+        if ((line[i] == '\'' || line[i] == '"') && (quoted == 0 || quoted == line[i])) {
+            quoted = quoted ? 0 : line[i];
+            continue;
+        }
+        if (line[i] != '!' || quoted == '\'' || (i > 0 && !isspace((unsigned char) line[i - 1])) ||
+            isspace((unsigned char) next) || next == '=' || next == '(' || next == '"') {
+            continue;
+        }
+        // the event runs to the end of the word
+        size_t end = i + 1;
+        while (end < n && !isspace((unsigned char) line[end])) end++;
+        if (events++ == 0) flock(h->fd, LOCK_SH);
+        history_sync(h);
+
+        struct history_entry const *e = NULL;
+        if (next == '!') {
+            e = history_entry(h, h->last_seq ? h->last_seq : h->hdr->next_seq - 1);
+            end = i + 2;
+        } else if (isdigit((unsigned char) next)) {
+            char *digits_end;
+            e = history_entry(h, strtoull(line + i + 1, &digits_end, 10));
+            end = (size_t) (digits_end - line);
+        } else {
+            int substring = next == '?';
+            char const *text = line + i + 1 + substring;
+            size_t text_len = end - (i + 1 + substring);
+            if (substring && text_len > 0 && text[text_len - 1] == '?') text_len--;
+            ssize_t id = text_len > 0 ? history_search(h, text, text_len, !substring, h->len) : -1;
+            if (id != -1) e = &h->entries[id];
+        }
+        if (e == NULL) {
+            // runs as typed
+            events--;
+            if (events == 0) flock(h->fd, LOCK_UN);
+            i = end - 1;
+            continue;
+        }
+
+        // copy the text before the event, then the line it names
+        size_t before = (size_t) (line + i - copied);
+        if (out + before + e->len + n + 1 > h->line_cap) {
+            h->line_cap = (out + before + e->len + n + 1) * 2;
+            void *tmp = realloc(h->line, h->line_cap);
+            if (!tmp) err(1, "realloc");
+            h->line = tmp;
+        }
+        memcpy(h->line + out, copied, before);
+        memcpy(h->line + out + before, history_text(h, e), e->len);
+        out += before + e->len;
+        copied = line + end;
+        i = end - 1;
+    }
+    if (events == 0) return line;
+    flock(h->fd, LOCK_UN);
+
+    size_t rest = (size_t) (line + n - copied);
+    memcpy(h->line + out, copied, rest);
+    out += rest;
+    *len = out;
+    printf("%.*s", (int) out, h->line);
+    if (out == 0 || h->line[out - 1] != '\n') putchar('\n');
+    fflush(stdout);
+    return h->line;
+}
+
+/**
+ * Prints the history - history [N] lists the last N lines (all without N) with their numbers, history -s TEXT...
+ * the lines containing TEXT, newest first, through the trigram index
+ */
+int history_builtin(size_t i, struct sh_options *opts) {
+    struct history *h = &opts->history;
+    size_t args = opts->n_words - i - 1;
+    char *end = NULL;
+    unsigned long long count = args == 1 ? strtoull(words[i + 1], &end, 10) : 0;
+    int search = args >= 2 && strcmp("-s", words[i + 1]) == 0;
+    if (args > 0 && !search && (args > 1 || end == words[i + 1] || *end != '\0')) {
+        fprintf(stderr, "history: usage: history [N | -s TEXT...]\n");
+        opts->exit_status = 2;
+        return 1;
+    }
+    if (h->fd == -1) {
+        fprintf(stderr, "history: no history file\n");
+        opts->exit_status = 1;
+        return 1;
+    }
+
+    flock(h->fd, LOCK_SH);
+    history_sync(h);
+    if (search) {
+        // the words after -s, joined by single spaces
+        size_t len = 0;
+        for (size_t w = i + 2; w < opts->n_words; w++) len += strlen(words[w]) + 1;
+        char *text = arena_alloc(&line_arena, len);
+        len = 0;
+        for (size_t w = i + 2; w < opts->n_words; w++) {
+            len += (size_t) sprintf(text + len, "%s%s", len ? " " : "", words[w]);
+        }
+        for (ssize_t id = (ssize_t) h->len; (id = history_search(h, text, len, 0, (size_t) id)) != -1; ) {
+            printf("%5ju  %.*s\n", (uintmax_t) h->entries[id].seq, (int) h->entries[id].len,
+                   history_text(h, &h->entries[id]));
+        }
+    } else {
+        size_t first = args == 1 && count < h->len ? h->len - count : 0;
+        for (size_t e = first; e < h->len; e++) {
+            if (h->entries[e].seq < h->hdr->first_seq) continue;
+            printf("%5ju  %.*s\n", (uintmax_t) h->entries[e].seq, (int) h->entries[e].len,
+                   history_text(h, &h->entries[e]));
+        }
+    }
+    flock(h->fd, LOCK_UN);
+    fflush(stdout);
+    opts->exit_status = 0;
+    return 0;
 }
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Builtin parity - runs every line of tests/parity.cases through smallsh twice, once answered by its in-process
+# builtins and once with the first word spelled /usr/bin/NAME so the program runs instead, and diffs stdout, stderr,
+# exit status and the files each run left behind.
+#   usage: tests/parity.sh [SMALLSH] [CASES]
+smallsh=$(realpath "${1:-./smallsh}")
+cases=$(realpath "${2:-$(dirname "$0")/parity.cases}")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# runs the line in $1 in a fresh directory, the same path for both runs so pwd agrees, and keeps the results as $2.*
+run_case() {
+    mkdir "$work/cwd"
+    printf '%s\n' "$1" > "$work/line"
+    (cd "$work/cwd" && "$smallsh" "$work/line" > "$2.stdout" 2> "$2.stderr"; echo "status $?") > "$2.status"
+    for f in "$work/cwd"/*; do
+        [ -e "$f" ] && { echo "file ${f##*/}:"; cat "$f"; }
+    done >> "$2.status"
+    rm -rf "$work/cwd"
+    # the programs name themselves by argv[0]
+    for part in stdout stderr status; do
+        sed -i 's|/usr/bin/||g' "$2.$part"
+    done
+}
+
+pass=0 fail=0 n=0
+while IFS= read -r line; do
+    case "$line" in ''|'#'*) continue ;; esac
+    n=$((n + 1))
+    run_case "$line" "$work/builtin$n"
+    run_case "/usr/bin/$line" "$work/program$n"
+    out=""
+    for part in stdout stderr status; do
+        d=$(diff "$work/builtin$n.$part" "$work/program$n.$part") || out="$out$part:
+$d
+"
+    done
+    if [ -z "$out" ]; then
+        pass=$((pass + 1))
+    else
+        fail=$((fail + 1))
+        printf 'FAIL: %s\n%s' "$line" "$out"
+    fi
+done < "$cases"
+echo "parity: $pass passed, $fail failed"
+[ "$fail" -eq 0 ]